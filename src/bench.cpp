@@ -0,0 +1,386 @@
+// Copyright (c) 2018 Daktronics. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+//
+// microbenchmark for the surface queue ... measures the cost of handing
+// a frame from producer -> consumer -> pool for each queue type
+//
+
+#include "scene.h"
+#include "util.h"
+#include "executor.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <chrono>
+
+using namespace std;
+
+namespace {
+
+	//
+	// no-op surface - we only care about the exchange
+	//
+	class NullSurface : public ISurface
+	{
+	public:
+		uint32_t width() const override { return 0; }
+		uint32_t height() const override { return 0; }
+		void* share_handle() const override { return nullptr; }
+	};
+
+	class NullAllocator : public ISurfaceAllocator
+	{
+	public:
+		shared_ptr<ISurface> allocate() override {
+			return make_shared<NullSurface>();
+		}
+		void release(shared_ptr<ISurface> const&) override {}
+	};
+
+	shared_ptr<ISurfaceQueue> create_queue(SurfaceQueueType type, uint32_t surfaces)
+	{
+		SurfaceQueueOptions options;
+		options.type = type;
+
+		auto const queue = create_surface_queue(options);
+		for (uint32_t n = 0; n < surfaces; ++n) {
+			queue->checkin(make_shared<NullSurface>());
+		}
+		return queue;
+	}
+
+	//
+	// producer and consumer on the same thread - raw operation overhead
+	//
+	double run_inline(SurfaceQueueType type, uint32_t frames)
+	{
+		auto const queue = create_queue(type, 3);
+
+		auto const start = time_now();
+		for (uint32_t n = 0; n < frames; ++n)
+		{
+			auto const target = queue->checkout(100);
+			queue->produce(target);
+			auto const surface = queue->consume(100);
+			queue->checkin(surface);
+		}
+		return (time_now() - start) * 1000.0 / frames;
+	}
+
+	//
+	// producer and consumer on their own threads - same topology
+	// as the concurrent render loops
+	//
+	double run_threaded(
+		SurfaceQueueType type, uint32_t frames, SurfaceQueueStats& stats)
+	{
+		auto const queue = create_queue(type, 3);
+
+		auto const start = time_now();
+
+		thread consumer([&]() {
+			for (uint32_t n = 0; n < frames; ++n) {
+				queue->checkin(queue->consume(100));
+			}
+		});
+
+		for (uint32_t n = 0; n < frames; ++n) {
+			queue->produce(queue->checkout(100));
+		}
+
+		consumer.join();
+		auto const elapsed = time_now() - start;
+
+		stats = queue->stats();
+		return elapsed * 1000.0 / frames;
+	}
+
+#if defined(_WIN32)
+	//
+	// both ends of a cross-process queue in this process ... the cost
+	// of the shared memory handoff itself
+	//
+	double run_shared(uint32_t frames)
+	{
+		SurfaceQueueOptions options;
+		options.max_surfaces = 3;
+
+		auto const producer = create_shared_surface_queue(
+			"bench", SurfaceQueueRole::producer, options, make_shared<NullAllocator>());
+		auto const consumer = create_shared_surface_queue(
+			"bench", SurfaceQueueRole::consumer);
+		if (!producer || !consumer) {
+			return 0.0;
+		}
+
+		auto const start = time_now();
+
+		thread t([&]() {
+			for (uint32_t n = 0; n < frames; ++n) {
+				consumer->checkin(consumer->consume(100));
+			}
+		});
+
+		for (uint32_t n = 0; n < frames; ++n) {
+			producer->produce(producer->checkout(100));
+		}
+
+		t.join();
+		return (time_now() - start) * 1000.0 / frames;
+	}
+#endif
+
+	//
+	// a producer/consumer pair driven entirely by executor callbacks
+	//
+	class Pipeline : public enable_shared_from_this<Pipeline>
+	{
+	private:
+		shared_ptr<IExecutor> const executor_;
+		shared_ptr<ISurfaceQueue> const queue_;
+		uint32_t const frames_;
+		uint32_t produced_;
+		uint32_t consumed_;
+		atomic<uint32_t>& finished_;
+
+	public:
+		Pipeline(shared_ptr<IExecutor> const& executor,
+			shared_ptr<ISurfaceQueue> const& queue,
+			uint32_t frames,
+			atomic<uint32_t>& finished)
+			: executor_(executor)
+			, queue_(queue)
+			, frames_(frames)
+			, produced_(0)
+			, consumed_(0)
+			, finished_(finished) {
+		}
+
+		void start() 
+		{
+			produce();
+			consume();
+		}
+
+	private:
+
+		void produce()
+		{
+			auto const self = shared_from_this();
+			async_checkout(executor_, queue_, 100, [self](shared_ptr<ISurface> const& s) {
+				self->queue_->produce(s);
+				if (s && ++self->produced_ < self->frames_) {
+					self->produce();
+				}
+				else {
+					++self->finished_;
+				}
+			});
+		}
+
+		void consume()
+		{
+			auto const self = shared_from_this();
+			async_consume(executor_, queue_, 100, [self](shared_ptr<ISurface> const& s) {
+				self->queue_->checkin(s);
+				if (s && ++self->consumed_ < self->frames_) {
+					self->consume();
+				}
+				else {
+					++self->finished_;
+				}
+			});
+		}
+	};
+
+	//
+	// many pipelines sharing a few executor threads
+	//
+	double run_executor(uint32_t pipelines, uint32_t threads, uint32_t frames)
+	{
+		auto const executor = create_executor(threads);
+
+		atomic<uint32_t> finished(0);
+		vector<shared_ptr<Pipeline>> list;
+		for (uint32_t n = 0; n < pipelines; ++n) {
+			list.push_back(make_shared<Pipeline>(
+				executor, create_queue(SurfaceQueueType::locked, 3), frames, finished));
+		}
+
+		auto const start = time_now();
+		for (auto const& p : list) {
+			p->start();
+		}
+
+		while (finished < (pipelines * 2)) {
+			this_thread::sleep_for(1ms);
+		}
+		return (time_now() - start) * 1000.0 / (double(frames) * pipelines);
+	}
+
+#if defined(__cpp_impl_coroutine)
+	//
+	// the executor pipeline again as coroutines ... producers and consumers
+	// on executors of their own, so each co_await has to resume on the
+	// right one
+	//
+	DetachedTask produce_loop(shared_ptr<IExecutor> executor, 
+		shared_ptr<ISurfaceQueue> queue, uint32_t frames, atomic<uint32_t>& finished)
+	{
+		for (uint32_t n = 0; n < frames; ++n)
+		{
+			auto const surface = co_await checkout_async(executor, queue, 100);
+			if (!surface) {
+				break;
+			}
+			queue->produce(surface);
+		}
+		++finished;
+	}
+
+	DetachedTask consume_loop(shared_ptr<IExecutor> executor, 
+		shared_ptr<ISurfaceQueue> queue, uint32_t frames, atomic<uint32_t>& finished)
+	{
+		for (uint32_t n = 0; n < frames; ++n)
+		{
+			auto const surface = co_await consume_async(executor, queue, 100);
+			if (!surface) {
+				break;
+			}
+			queue->checkin(surface);
+		}
+		++finished;
+	}
+
+	double run_coroutines(uint32_t pipelines, uint32_t threads, uint32_t frames)
+	{
+		auto const producers = create_executor(max(1u, threads / 2));
+		auto const consumers = create_executor(max(1u, threads / 2));
+
+		vector<shared_ptr<ISurfaceQueue>> queues;
+		for (uint32_t n = 0; n < pipelines; ++n) {
+			queues.push_back(create_queue(SurfaceQueueType::locked, 3));
+		}
+
+		atomic<uint32_t> finished(0);
+		auto const start = time_now();
+		for (auto const& q : queues)
+		{
+			produce_loop(producers, q, frames, finished);
+			consume_loop(consumers, q, frames, finished);
+		}
+
+		while (finished < (pipelines * 2)) {
+			this_thread::sleep_for(1ms);
+		}
+		return (time_now() - start) * 1000.0 / (double(frames) * pipelines);
+	}
+#endif
+
+	//
+	// time from close() until a consumer blocked in consume() is back ...
+	// should be a wake-up, not the consume timeout
+	//
+	double run_shutdown(SurfaceQueueType type, uint32_t rounds)
+	{
+		double total = 0.0;
+		for (uint32_t n = 0; n < rounds; ++n)
+		{
+			auto const queue = create_queue(type, 3);
+
+			atomic<bool> waiting(false);
+			atomic<uint64_t> woke(0);
+			thread consumer([&]() {
+				waiting = true;
+				queue->consume(1000);
+				woke = time_now();
+			});
+
+			// give the consumer time to park
+			while (!waiting) {
+				this_thread::yield();
+			}
+			this_thread::sleep_for(5ms);
+
+			auto const start = time_now();
+			queue->close();
+			consumer.join();
+
+			total += double(woke - start);
+		}
+		return total / rounds;
+	}
+
+	const char* to_string(SurfaceQueueType type)
+	{
+		switch (type)
+		{
+			case SurfaceQueueType::ring: return "ring";
+			case SurfaceQueueType::locked:
+			default: return "locked";
+		}
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	uint32_t frames = 1000000;
+	uint32_t pipelines = 32;
+	uint32_t threads = 2;
+	for (int n = 1; n < argc; ++n)
+	{
+		if (strncmp(argv[n], "--frames=", 9) == 0) {
+			frames = to_int(argv[n] + 9, frames);
+		}
+		else if (strncmp(argv[n], "--pipelines=", 12) == 0) {
+			pipelines = to_int(argv[n] + 12, pipelines);
+		}
+		else if (strncmp(argv[n], "--threads=", 10) == 0) {
+			threads = to_int(argv[n] + 10, threads);
+		}
+	}
+
+	printf("surface queue handoff cost (%u frames)\n", frames);
+	printf("%-8s %14s %14s %16s %16s %14s\n", "queue", "inline ns/f", 
+		"threaded ns/f", "checkout p99 us", "consume p99 us", "close wake us");
+
+	SurfaceQueueType const types[] = {
+		SurfaceQueueType::locked, SurfaceQueueType::ring };
+
+	for (auto const type : types)
+	{
+		SurfaceQueueStats stats;
+		auto const inline_ns = run_inline(type, frames);
+		auto const threaded_ns = run_threaded(type, frames, stats);
+		auto const shutdown_us = run_shutdown(type, 20);
+		printf("%-8s %14.1f %14.1f %16llu %16llu %14.1f\n", 
+			to_string(type), inline_ns, threaded_ns,
+			static_cast<unsigned long long>(stats.checkout_wait.percentile(0.99)),
+			static_cast<unsigned long long>(stats.consume_wait.percentile(0.99)),
+			shutdown_us);
+	}
+
+#if defined(_WIN32)
+	printf("%-8s %14s %14.1f\n", "shared", "-", run_shared(frames));
+#endif
+
+	// every pipeline runs the full frame count ... keep the total sane
+	auto const executor_frames = max(1u, frames / pipelines);
+	printf("\n%u pipelines on %u executor threads (%u frames each): %.1f ns/f\n",
+		pipelines, threads, executor_frames, 
+		run_executor(pipelines, threads, executor_frames));
+
+#if defined(__cpp_impl_coroutine)
+	printf("%u pipelines as coroutines on %u executor threads: %.1f ns/f\n",
+		pipelines, threads, run_coroutines(pipelines, threads, executor_frames));
+#endif
+
+	return 0;
+}
@@ -0,0 +1,137 @@
+// Copyright (c) 2018 Daktronics. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+#include "channels.h"
+#include "util.h"
+#include "trace.h"
+
+#include <mutex>
+
+using namespace std;
+
+namespace {
+
+	class Channel
+	{
+	private:
+		uint32_t const id_;
+		shared_ptr<IScene> const producer_;
+		vector<shared_ptr<IScene>> const consumers_;
+
+		// written by whichever worker ran the last step, read by stats()
+		mutable mutex lock_;
+		uint64_t frames_;
+		Histogram busy_;
+
+	public:
+		Channel(uint32_t id, shared_ptr<IScene> const& producer,
+				vector<shared_ptr<IScene>> const& consumers)
+			: id_(id)
+			, producer_(producer)
+			, consumers_(consumers)
+			, frames_(0) {
+		}
+
+		// the same order as a sync render loop ... so each consumer finds
+		// the producer's frame waiting in the queue
+		void step(double t, int32_t sync_interval)
+		{
+			TRACE_ZONE("channel");
+			auto const start = time_now();
+
+			producer_->tick(t);
+			producer_->render();
+			for (auto const& consumer : consumers_)
+			{
+				consumer->tick(t);
+				consumer->render();
+			}
+
+			producer_->present(0);
+			for (auto const& consumer : consumers_) {
+				consumer->present(sync_interval);
+			}
+
+			auto const elapsed = time_now() - start;
+
+			lock_guard<mutex> guard(lock_);
+			++frames_;
+			busy_.add(elapsed);
+		}
+
+		ChannelStats stats() const
+		{
+			ChannelStats stats;
+			stats.id = id_;
+			stats.queue = producer_->queue()->stats();
+
+			lock_guard<mutex> guard(lock_);
+			stats.frames = frames_;
+			stats.busy = busy_;
+			return stats;
+		}
+	};
+
+	class ChannelManager : public IChannelManager
+	{
+	private:
+		shared_ptr<IJobSystem> const jobs_;
+		vector<shared_ptr<Channel>> channels_;
+
+	public:
+		ChannelManager(shared_ptr<IJobSystem> const& jobs)
+			: jobs_(jobs) {
+		}
+
+		uint32_t add(shared_ptr<IScene> const& producer,
+			vector<shared_ptr<IScene>> const& consumers) override
+		{
+			auto const id = static_cast<uint32_t>(channels_.size());
+			channels_.push_back(make_shared<Channel>(id, producer, consumers));
+			return id;
+		}
+
+		size_t channels() const override {
+			return channels_.size();
+		}
+
+		void step(double t, int32_t sync_interval) override
+		{
+			// a job per channel, then wait on one that follows them all
+			// ... we run channels ourselves while we wait
+			vector<Job> steps;
+			steps.reserve(channels_.size());
+			for (auto const& channel : channels_)
+			{
+				steps.push_back(jobs_->run([channel, t, sync_interval]() {
+					channel->step(t, sync_interval);
+				}));
+			}
+			jobs_->wait(jobs_->run([]() {}, steps));
+		}
+
+		vector<ChannelStats> stats() const override
+		{
+			vector<ChannelStats> stats;
+			stats.reserve(channels_.size());
+			for (auto const& channel : channels_) {
+				stats.push_back(channel->stats());
+			}
+			return stats;
+		}
+
+		uint32_t threads() const override {
+			return jobs_->threads();
+		}
+	};
+}
+
+shared_ptr<IChannelManager> create_channel_manager(shared_ptr<IJobSystem> const& jobs)
+{
+	auto const pool = jobs ? jobs : create_job_system();
+	if (!pool) {
+		return nullptr;
+	}
+	return make_shared<ChannelManager>(pool);
+}
@@ -0,0 +1,64 @@
+// Copyright (c) 2018 Daktronics. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include "scene.h"
+#include "jobs.h"
+
+//
+// a single channel's totals
+//
+struct ChannelStats
+{
+	uint32_t id = 0;
+
+	// # of times the channel has been stepped
+	uint64_t frames = 0;
+
+	// time (us) each step took (tick + render + present of every scene)
+	Histogram busy;
+
+	// the channel's surface queue
+	SurfaceQueueStats queue;
+};
+
+//
+// runs many independent pipelines (channels) in one process ... each
+// channel is a producer and its consumer(s), with their own surface queue,
+// and every step updates + renders + presents all of them once, spread
+// across a job system
+//
+// channels are stepped together (like outputs locked to one reference) ...
+// within a channel the scenes run in order, as they do on a sync pipeline
+//
+class IChannelManager
+{
+public:
+	IChannelManager() {}
+	virtual ~IChannelManager() {}
+
+	// returns the new channel's id ... channels can't be added while a
+	// step is running
+	virtual uint32_t add(std::shared_ptr<IScene> const& producer,
+		std::vector<std::shared_ptr<IScene>> const& consumers) = 0;
+
+	virtual size_t channels() const = 0;
+
+	// tick (at t seconds), render and present every channel once ... returns
+	// once they are all done
+	virtual void step(double t, int32_t sync_interval) = 0;
+
+	virtual std::vector<ChannelStats> stats() const = 0;
+
+	virtual uint32_t threads() const = 0;
+
+private:
+	IChannelManager(IChannelManager const&) = delete;
+	IChannelManager& operator=(IChannelManager const&) = delete;
+};
+
+// null jobs = a job system of its own (see create_job_system)
+std::shared_ptr<IChannelManager> create_channel_manager(
+	std::shared_ptr<IJobSystem> const& jobs = nullptr);
@@ -0,0 +1,99 @@
+// Copyright (c) 2018 Daktronics. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include "util.h"
+
+#include <atomic>
+
+//
+// a pausable-clock for scene time (nanoseconds) ... paused/resumed from
+// one thread (eg. the ui) and read from the render thread(s)
+//
+// with a fixed step, the time for a loop's nth tick is exactly n steps
+// regardless of wall time ... so a run renders the same frames every time
+//
+class Clock
+{
+private:
+	// start and pause in a single word, so a reader never sees one of
+	// them updated without the other ... running: the (shifted) start time,
+	// paused: the (shifted) elapsed time with the low bit set, stopped: -1
+	static const int64_t paused_bit = 1ll;
+	std::atomic<int64_t> state_;
+
+	// ns per tick (0 = follow the wall clock)
+	int64_t step_;
+
+public:
+	Clock()
+		: state_(-1ll)
+		, step_(0ll) {
+		start();
+	}
+
+	void start()
+	{
+		auto const t = static_cast<int64_t>(time_now_ns());
+		auto const state = state_.load();
+		if (state >= 0ll && (state & paused_bit)) {
+			state_ = (t - (state >> 1)) << 1;
+		}
+		else {
+			state_ = t << 1;
+		}
+	}
+
+	void stop() {
+		state_ = -1ll;
+	}
+
+	void pause()
+	{
+		auto const state = state_.load();
+		if (state >= 0ll && !(state & paused_bit)) {
+			auto const elapsed = static_cast<int64_t>(time_now_ns()) - (state >> 1);
+			state_ = (elapsed << 1) | paused_bit;
+		}
+	}
+
+	bool is_paused() const {
+		auto const state = state_.load();
+		return state >= 0ll && (state & paused_bit);
+	}
+
+	// set before any render loop starts ... 0 goes back to wall time
+	void set_fixed_step(int64_t step_ns) {
+		step_ = (step_ns > 0ll) ? step_ns : 0ll;
+	}
+
+	int64_t fixed_step() const {
+		return step_;
+	}
+
+	// wall time (ns) since start, less any time spent paused
+	int64_t now() const 
+	{
+		auto const state = state_.load();
+		if (state < 0ll) {
+			return 0ll;
+		}
+		if (state & paused_bit) {
+			return state >> 1;
+		}
+		return static_cast<int64_t>(time_now_ns()) - (state >> 1);
+	}
+
+	// scene time (seconds) for a loop's nth tick ... callers only count
+	// the ticks they make while not paused
+	double tick_time(int64_t tick) const {
+		return ((step_ > 0ll) ? (tick * step_) : now()) / 1000000000.0;
+	}
+};
+
+// ns per tick for a rate (eg. 59.94 Hz) ... 0 if there's no rate
+inline int64_t to_step(double hz) {
+	return (hz > 0.0) ? static_cast<int64_t>(1000000000.0 / hz + 0.5) : 0ll;
+}
@@ -22,10 +22,12 @@ namespace {
 		string text_;
 		vector<shared_ptr<Glyph const>> glyphs_;
 		shared_ptr<IFontAtlas const> const font_;
+		uint32_t revision_;
 
 	public:
 		Line(shared_ptr<IFontAtlas const> const& font) 
-			: font_(font) {
+			: font_(font)
+			, revision_(1) {
 		}
 		
 		void write(string const& text)
@@ -33,9 +35,14 @@ namespace {
 			if (text != text_) {
 				text_ = text;
 				map_glyphs(text);
+				++revision_;
 			}
 		}
 
+		uint32_t revision() const {
+			return revision_;
+		}
+
 		int32_t length() const {
 			return int32_t(glyphs_.size());
 		}
@@ -123,6 +130,14 @@ namespace {
 			return vector<shared_ptr<Glyph const>>();
 		}
 
+		uint32_t line_revision(int32_t n) const override
+		{
+			if (n >= 0 && n < int32_t(lines_.size())) {
+				return lines_[n]->revision();
+			}
+			return 0;
+		}
+
 		int32_t line_count() const override {
 			return int32_t(lines_.size());
 		}
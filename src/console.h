@@ -24,6 +24,10 @@ public:
 
 	virtual std::vector<std::shared_ptr<Glyph const>> get_line(int32_t) const = 0;
 
+	// changes whenever the line's text does ... so geometry built from a
+	// line only needs rebuilding when this moves on
+	virtual uint32_t line_revision(int32_t) const = 0;
+
 	virtual int32_t line_count() const = 0;
 	virtual int32_t column_count() const = 0;
 
@@ -557,6 +557,40 @@ namespace d3d11 {
 		return nullptr;
 	}
 
+	shared_ptr<Geometry> Device::create_geometry(vector<Vertex> const& vertices)
+	{
+		if (vertices.empty()) {
+			return nullptr;
+		}
+
+		vector<SimpleVertex> data;
+		data.reserve(vertices.size());
+		for (auto const& v : vertices) {
+			data.push_back({ DirectX::XMFLOAT3(v.x, v.y, v.z), DirectX::XMFLOAT2(v.u, v.v) });
+		}
+
+		D3D11_BUFFER_DESC desc = {};
+		desc.Usage = D3D11_USAGE_DEFAULT;
+		desc.ByteWidth = static_cast<UINT>(sizeof(SimpleVertex) * data.size());
+		desc.BindFlags = D3D11_BIND_VERTEX_BUFFER;
+		desc.CPUAccessFlags = 0;
+
+		D3D11_SUBRESOURCE_DATA srd = {};
+		srd.pSysMem = data.data();
+
+		ID3D11Buffer* buffer = nullptr;
+		auto const hr = device_->CreateBuffer(&desc, &srd, &buffer);
+		if (SUCCEEDED(hr)) {
+			return make_shared<Geometry>(
+				D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST, 
+				static_cast<uint32_t>(data.size()), 
+				static_cast<uint32_t>(sizeof(SimpleVertex)), 
+				buffer);
+		}
+
+		return nullptr;
+	}
+
 	shared_ptr<Texture2D> Device::open_shared_texture(void* handle)
 	{
 		if (!handle) {
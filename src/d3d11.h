@@ -9,6 +9,7 @@
 #include <d3d11_1.h>
 #include <memory>
 #include <string>
+#include <vector>
 
 namespace d3d11 {
 
@@ -18,6 +19,13 @@ namespace d3d11 {
 	class Texture2D;
 	class Context;
 
+	// a position (in clip space) and texture coordinate
+	struct Vertex
+	{
+		float x, y, z;
+		float u, v;
+	};
+
 	template<class T>
 	class ScopedBinder
 	{
@@ -71,6 +79,9 @@ namespace d3d11 {
 		std::shared_ptr<Geometry> create_quad(
 					float x, float y, float width, float height, bool flip=false);
 
+		// a triangle list ... eg. a quad per glyph for some text
+		std::shared_ptr<Geometry> create_geometry(std::vector<Vertex> const&);
+
 		std::shared_ptr<Texture2D> create_texture(
 					int width, 
 					int height, 
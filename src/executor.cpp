@@ -0,0 +1,409 @@
+// Copyright (c) 2018 Daktronics. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+#include "executor.h"
+#include "util.h"
+
+#include <list>
+#include <map>
+#include <set>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+
+using namespace std;
+
+namespace {
+
+	class Executor : public IExecutor
+	{
+	private:
+		typedef chrono::steady_clock::time_point TimePoint;
+
+		struct Timer
+		{
+			TimePoint due;
+			function<void()> callback;
+		};
+
+		// shared with the worker threads so a worker can outlive us when
+		// the last reference is dropped from one of its own tasks
+		//
+		// timers are kept by id (so cancel() can take them out) and in 
+		// due order
+		struct State
+		{
+			deque<function<void()>> tasks;
+			map<uint64_t, Timer> timers;
+			set<pair<TimePoint, uint64_t>> due;
+			uint64_t next_timer = 1;
+			condition_variable signal;
+			mutex lock;
+			bool stop = false;
+		};
+
+		shared_ptr<State> const state_;
+		vector<thread> threads_;
+
+	public:
+		Executor(uint32_t threads)
+			: state_(make_shared<State>())
+		{
+			for (uint32_t n = 0; n < max(threads, 1u); ++n) {
+				threads_.push_back(thread(run, state_));
+			}
+		}
+
+		~Executor()
+		{
+			{
+				lock_guard<mutex> guard(state_->lock);
+				state_->stop = true;
+			}
+			state_->signal.notify_all();
+
+			for (auto& t : threads_)
+			{
+				if (t.get_id() == this_thread::get_id()) {
+					t.detach();
+				}
+				else {
+					t.join();
+				}
+			}
+		}
+
+		void post(function<void()> const& callback) override
+		{
+			{
+				lock_guard<mutex> guard(state_->lock);
+				state_->tasks.push_back(callback);
+			}
+			state_->signal.notify_one();
+		}
+
+		uint64_t post_after(uint32_t delay_ms, function<void()> const& callback) override
+		{
+			Timer timer;
+			timer.due = chrono::steady_clock::now() + (delay_ms * 1ms);
+			timer.callback = callback;
+
+			uint64_t id;
+			{
+				lock_guard<mutex> guard(state_->lock);
+				id = state_->next_timer++;
+				state_->due.insert(make_pair(timer.due, id));
+				state_->timers.insert(make_pair(id, move(timer)));
+			}
+			state_->signal.notify_one();
+			return id;
+		}
+
+		void cancel(uint64_t id) override
+		{
+			lock_guard<mutex> guard(state_->lock);
+			auto const i = state_->timers.find(id);
+			if (i != state_->timers.end())
+			{
+				state_->due.erase(make_pair(i->second.due, id));
+				state_->timers.erase(i);
+			}
+		}
+
+	private:
+
+		static void run(shared_ptr<State> state)
+		{
+			unique_lock<mutex> lock(state->lock);
+			while (!state->stop)
+			{
+				// expired timers are just more tasks
+				auto const now = chrono::steady_clock::now();
+				while (!state->due.empty() && state->due.begin()->first <= now)
+				{
+					auto const i = state->timers.find(state->due.begin()->second);
+					state->tasks.push_back(move(i->second.callback));
+					state->timers.erase(i);
+					state->due.erase(state->due.begin());
+				}
+
+				if (!state->tasks.empty())
+				{
+					auto const task = move(state->tasks.front());
+					state->tasks.pop_front();
+
+					lock.unlock();
+					task();
+					lock.lock();
+					continue;
+				}
+
+				if (state->due.empty()) {
+					state->signal.wait(lock);
+				}
+				else {
+					// a copy ... the timer can be cancelled while we wait
+					auto const due = state->due.begin()->first;
+					state->signal.wait_until(lock, due);
+				}
+			}
+		}
+	};
+
+	//
+	// asynchronous operations waiting on a single queue ... the queue's
+	// signal schedules a poll on the executor, and each waiter either gets
+	// a surface from that poll or times out
+	//
+	class Waiters : public enable_shared_from_this<Waiters>
+	{
+	private:
+		// timer is the executor's timeout for the waiter (0 until it's set)
+		// ... cancelled once the waiter gets a surface, so finished waits
+		// don't pile up on the executor
+		struct Waiter
+		{
+			uint64_t id;
+			bool consume;
+			SurfaceCallback callback;
+			uint64_t timer;
+		};
+
+		weak_ptr<ISurfaceQueue> const queue_;
+		weak_ptr<IExecutor> const executor_;
+		list<Waiter> waiters_;
+		uint64_t next_id_;
+		atomic_bool scheduled_;
+		mutex lock_;
+
+	public:
+		Waiters(shared_ptr<ISurfaceQueue> const& queue,
+				shared_ptr<IExecutor> const& executor)
+			: queue_(queue)
+			, executor_(executor)
+			, next_id_(0)
+			, scheduled_(false) {
+		}
+
+		bool watches(shared_ptr<ISurfaceQueue> const& queue) const {
+			return queue_.lock() == queue;
+		}
+
+		bool runs_on(shared_ptr<IExecutor> const& executor) const {
+			return executor_.lock() == executor;
+		}
+
+		void add(bool consume, uint32_t timeout_ms, SurfaceCallback const& callback)
+		{
+			auto const executor = executor_.lock();
+			if (!executor) {
+				return;
+			}
+
+			uint64_t id;
+			{
+				lock_guard<mutex> guard(lock_);
+				id = next_id_++;
+				waiters_.push_back({ id, consume, callback, 0 });
+			}
+
+			weak_ptr<Waiters> weak_this(shared_from_this());
+			auto const timer = executor->post_after(timeout_ms, [weak_this, id]() {
+				auto const self = weak_this.lock();
+				if (self) {
+					self->expire(id);
+				}
+			});
+
+			// the waiter may have been completed by a poll already
+			auto done = true;
+			{
+				lock_guard<mutex> guard(lock_);
+				for (auto& w : waiters_)
+				{
+					if (w.id == id) {
+						w.timer = timer;
+						done = false;
+						break;
+					}
+				}
+			}
+			if (done) {
+				executor->cancel(timer);
+			}
+
+			// a surface may already be waiting for us
+			poke();
+		}
+
+		//
+		// queue signal ... only one poll needs to be scheduled at a time
+		//
+		void poke()
+		{
+			if (scheduled_.exchange(true)) {
+				return;
+			}
+
+			auto const executor = executor_.lock();
+			if (!executor) {
+				return;
+			}
+
+			auto const self = shared_from_this();
+			executor->post([self]() {
+				self->scheduled_.store(false);
+				self->poll();
+			});
+		}
+
+	private:
+
+		void poll()
+		{
+			auto const queue = queue_.lock();
+			if (!queue) {
+				return;
+			}
+
+			// a closed queue completes everyone with nullptr
+			auto const closed = queue->is_closed();
+
+			vector<pair<SurfaceCallback, shared_ptr<ISurface>>> ready;
+			vector<uint64_t> timers;
+			{
+				lock_guard<mutex> guard(lock_);
+				for (auto i = waiters_.begin(); i != waiters_.end(); )
+				{
+					auto const surface = i->consume ?
+						queue->try_consume() : queue->try_checkout();
+					if (surface || closed)
+					{
+						ready.push_back(make_pair(i->callback, surface));
+						if (i->timer) {
+							timers.push_back(i->timer);
+						}
+						i = waiters_.erase(i);
+					}
+					else {
+						++i;
+					}
+				}
+			}
+
+			auto const executor = executor_.lock();
+			if (executor)
+			{
+				for (auto const t : timers) {
+					executor->cancel(t);
+				}
+			}
+
+			for (auto const& r : ready) {
+				r.first(r.second);
+			}
+		}
+
+		void expire(uint64_t id)
+		{
+			SurfaceCallback callback;
+			{
+				lock_guard<mutex> guard(lock_);
+				for (auto i = waiters_.begin(); i != waiters_.end(); ++i)
+				{
+					if (i->id == id)
+					{
+						callback = i->callback;
+						waiters_.erase(i);
+						break;
+					}
+				}
+			}
+
+			if (callback) {
+				callback(nullptr);
+			}
+		}
+	};
+
+	//
+	// find (or create) the waiters for a queue on an executor ... each
+	// executor gets its own, so callbacks always run where they were asked
+	// to, and the queue's signal pokes every one of them
+	//
+	shared_ptr<Waiters> waiters_for(
+		shared_ptr<IExecutor> const& executor,
+		shared_ptr<ISurfaceQueue> const& queue)
+	{
+		typedef pair<ISurfaceQueue*, IExecutor*> Key;
+
+		static mutex lock;
+		static map<Key, weak_ptr<Waiters>> registry;
+
+		lock_guard<mutex> guard(lock);
+
+		auto const key = make_pair(queue.get(), executor.get());
+		auto waiters = registry[key].lock();
+		if (!waiters || !waiters->watches(queue) || !waiters->runs_on(executor))
+		{
+			waiters = make_shared<Waiters>(queue, executor);
+			registry[key] = waiters;
+
+			// forget about queues that have gone away ... and collect the
+			// waiters on this one, which the signal keeps alive as long as
+			// the queue is
+			vector<shared_ptr<Waiters>> signaled;
+			for (auto i = registry.begin(); i != registry.end(); )
+			{
+				auto const w = i->second.lock();
+				if (!w) {
+					i = registry.erase(i);
+					continue;
+				}
+				if (i->first.first == queue.get() && w->watches(queue)) {
+					signaled.push_back(w);
+				}
+				++i;
+			}
+
+			queue->set_signal([signaled]() {
+				for (auto const& w : signaled) {
+					w->poke();
+				}
+			});
+		}
+		return waiters;
+	}
+}
+
+shared_ptr<IExecutor> create_executor(uint32_t threads)
+{
+	return make_shared<Executor>(threads);
+}
+
+void async_checkout(
+	shared_ptr<IExecutor> const& executor,
+	shared_ptr<ISurfaceQueue> const& queue,
+	uint32_t timeout_ms,
+	SurfaceCallback const& callback)
+{
+	if (executor && queue && callback) {
+		waiters_for(executor, queue)->add(false, timeout_ms, callback);
+	}
+}
+
+void async_consume(
+	shared_ptr<IExecutor> const& executor,
+	shared_ptr<ISurfaceQueue> const& queue,
+	uint32_t timeout_ms,
+	SurfaceCallback const& callback)
+{
+	if (executor && queue && callback) {
+		waiters_for(executor, queue)->add(true, timeout_ms, callback);
+	}
+}
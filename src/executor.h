@@ -0,0 +1,152 @@
+// Copyright (c) 2018 Daktronics. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include "scene.h"
+
+#include <functional>
+#include <memory>
+
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#include <exception>
+#endif
+
+//
+// small pool of threads that runs callbacks ... many producer/consumer
+// pipelines can share an executor rather than each parking a thread
+// inside checkout() and consume()
+//
+class IExecutor
+{
+public:
+	IExecutor() {}
+	virtual ~IExecutor() {}
+
+	virtual void post(std::function<void()> const&) = 0;
+
+	// run a callback once delay_ms has passed ... returns an id for cancel()
+	virtual uint64_t post_after(uint32_t delay_ms, std::function<void()> const&) = 0;
+
+	// drop a timer before it fires (nothing happens if it already has)
+	virtual void cancel(uint64_t timer) = 0;
+
+private:
+	IExecutor(IExecutor const&) = delete;
+	IExecutor& operator=(IExecutor const&) = delete;
+};
+
+std::shared_ptr<IExecutor> create_executor(uint32_t threads);
+
+typedef std::function<void(std::shared_ptr<ISurface> const&)> SurfaceCallback;
+
+//
+// asynchronous versions of ISurfaceQueue::checkout() and consume()
+//
+// the callback runs on the executor with the surface ... or with nullptr
+// once timeout_ms passes without one becoming available
+//
+// these take over the queue's signal (see ISurfaceQueue::set_signal)
+//
+void async_checkout(
+	std::shared_ptr<IExecutor> const& executor,
+	std::shared_ptr<ISurfaceQueue> const& queue,
+	uint32_t timeout_ms,
+	SurfaceCallback const& callback);
+
+void async_consume(
+	std::shared_ptr<IExecutor> const& executor,
+	std::shared_ptr<ISurfaceQueue> const& queue,
+	uint32_t timeout_ms,
+	SurfaceCallback const& callback);
+
+#if defined(__cpp_impl_coroutine)
+
+//
+// C++20 coroutine support, for example:
+//
+//   auto const target = co_await checkout_async(executor, queue, 100);
+//
+// the coroutine resumes on one of the executor's threads
+//
+class SurfaceAwaiter
+{
+private:
+	std::shared_ptr<IExecutor> const executor_;
+	std::shared_ptr<ISurfaceQueue> const queue_;
+	uint32_t const timeout_ms_;
+	bool const consume_;
+	std::shared_ptr<ISurface> surface_;
+
+public:
+	SurfaceAwaiter(
+		std::shared_ptr<IExecutor> const& executor,
+		std::shared_ptr<ISurfaceQueue> const& queue,
+		uint32_t timeout_ms,
+		bool consume)
+		: executor_(executor)
+		, queue_(queue)
+		, timeout_ms_(timeout_ms)
+		, consume_(consume) {
+	}
+
+	bool await_ready()
+	{
+		surface_ = consume_ ? queue_->try_consume() : queue_->try_checkout();
+		return surface_ != nullptr;
+	}
+
+	void await_suspend(std::coroutine_handle<> handle)
+	{
+		auto const resume = [this, handle](std::shared_ptr<ISurface> const& s) {
+			surface_ = s;
+			handle.resume();
+		};
+
+		if (consume_) {
+			async_consume(executor_, queue_, timeout_ms_, resume);
+		}
+		else {
+			async_checkout(executor_, queue_, timeout_ms_, resume);
+		}
+	}
+
+	std::shared_ptr<ISurface> await_resume() {
+		return surface_;
+	}
+};
+
+inline SurfaceAwaiter checkout_async(
+	std::shared_ptr<IExecutor> const& executor,
+	std::shared_ptr<ISurfaceQueue> const& queue,
+	uint32_t timeout_ms)
+{
+	return SurfaceAwaiter(executor, queue, timeout_ms, false);
+}
+
+inline SurfaceAwaiter consume_async(
+	std::shared_ptr<IExecutor> const& executor,
+	std::shared_ptr<ISurfaceQueue> const& queue,
+	uint32_t timeout_ms)
+{
+	return SurfaceAwaiter(executor, queue, timeout_ms, true);
+}
+
+//
+// fire-and-forget coroutine type for pipeline loops
+//
+struct DetachedTask
+{
+	struct promise_type
+	{
+		DetachedTask get_return_object() { return DetachedTask(); }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+};
+
+#endif
@@ -0,0 +1,169 @@
+// Copyright (c) 2018 Daktronics. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+#include "fence.h"
+#include "util.h"
+#include "trace.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+namespace {
+
+	class CpuFence : public ICpuFence
+	{
+	private:
+		// checked without the lock ... the lock is only for waiters
+		atomic_bool signaled_;
+		mutex lock_;
+		condition_variable signal_;
+
+	public:
+		CpuFence() : signaled_(false) {
+		}
+
+		bool signaled() const override {
+			return signaled_.load(memory_order_acquire);
+		}
+
+		bool wait(uint32_t timeout_ms) override
+		{
+			if (signaled()) {
+				return true;
+			}
+
+			unique_lock<mutex> guard(lock_);
+			return signal_.wait_for(guard, chrono::milliseconds(timeout_ms),
+				[this]() { return signaled(); });
+		}
+
+		void signal() override
+		{
+			{
+				lock_guard<mutex> guard(lock_);
+				signaled_.store(true, memory_order_release);
+			}
+			signal_.notify_all();
+		}
+	};
+
+	class FenceWaiter : public IFenceWaiter
+	{
+	private:
+		struct Pending
+		{
+			shared_ptr<ISurface> surface;
+			SurfacePriority priority;
+		};
+
+		shared_ptr<ISurfaceQueue> const queue_;
+
+		mutable mutex lock_;
+		condition_variable submitted_;
+		deque<Pending> pending_;
+		bool stop_;
+
+		thread thread_;
+
+	public:
+		FenceWaiter(shared_ptr<ISurfaceQueue> const& queue)
+			: queue_(queue)
+			, stop_(false)
+		{
+			thread_ = thread([this]() { run(); });
+		}
+
+		~FenceWaiter()
+		{
+			{
+				lock_guard<mutex> guard(lock_);
+				stop_ = true;
+			}
+			submitted_.notify_all();
+			thread_.join();
+		}
+
+		void submit(shared_ptr<ISurface> const& surface, SurfacePriority priority) override
+		{
+			if (!surface) {
+				return;
+			}
+
+			{
+				lock_guard<mutex> guard(lock_);
+				pending_.push_back({ surface, priority });
+			}
+			submitted_.notify_one();
+		}
+
+		size_t pending() const override
+		{
+			lock_guard<mutex> guard(lock_);
+			return pending_.size();
+		}
+
+	private:
+
+		void run()
+		{
+			trace_thread_name("fence waiter");
+
+			for (;;)
+			{
+				Pending next;
+				{
+					unique_lock<mutex> guard(lock_);
+					submitted_.wait(guard, [this]() { return stop_ || !pending_.empty(); });
+					if (stop_) {
+						return;
+					}
+					next = pending_.front();
+				}
+
+				// the oldest surface first ... so the queue still sees them
+				// in the order they were rendered
+				{
+					TRACE_ZONE("fence wait");
+					if (!wait_for_fence(next.surface, 1000)) {
+						log_message("timeout waiting for a surface fence\n");
+					}
+				}
+
+				// the consumer can't wait on the fence ... and doesn't need to
+				next.surface->set_fence(nullptr);
+				queue_->produce(next.surface, next.priority);
+
+				lock_guard<mutex> guard(lock_);
+				pending_.pop_front();
+			}
+		}
+	};
+}
+
+shared_ptr<ICpuFence> create_cpu_fence() {
+	return make_shared<CpuFence>();
+}
+
+bool wait_for_fence(shared_ptr<ISurface> const& surface, uint32_t timeout_ms)
+{
+	auto const fence = surface ? surface->fence() : nullptr;
+	if (!fence || fence->signaled()) {
+		return true;
+	}
+	return fence->wait(timeout_ms);
+}
+
+shared_ptr<IFenceWaiter> create_fence_waiter(shared_ptr<ISurfaceQueue> const& queue)
+{
+	if (!queue) {
+		return nullptr;
+	}
+	return make_shared<FenceWaiter>(queue);
+}
@@ -0,0 +1,50 @@
+// Copyright (c) 2018 Daktronics. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include "scene.h"
+
+//
+// a fence signaled from the cpu ... the reference implementation (and
+// what the cpu backend uses)
+//
+class ICpuFence : public IFence
+{
+public:
+	virtual void signal() = 0;
+};
+
+std::shared_ptr<ICpuFence> create_cpu_fence();
+
+// consumer: lazily wait for a surface's writes before reading it ... true
+// right away for a surface without a fence
+bool wait_for_fence(std::shared_ptr<ISurface> const& surface, uint32_t timeout_ms);
+
+//
+// resolves fences on a dedicated thread ... submitted surfaces are
+// produced on the queue, in order, as their fences signal (eg. for a
+// consumer in another process, which can't wait on our fences)
+//
+class IFenceWaiter
+{
+public:
+	IFenceWaiter() {}
+	virtual ~IFenceWaiter() {}
+
+	// caller = producer, instead of ISurfaceQueue::produce()
+	virtual void submit(std::shared_ptr<ISurface> const&,
+		SurfacePriority priority = SurfacePriority::normal) = 0;
+
+	// # of surfaces submitted but not yet produced
+	virtual size_t pending() const = 0;
+
+private:
+	IFenceWaiter(IFenceWaiter const&) = delete;
+	IFenceWaiter& operator=(IFenceWaiter const&) = delete;
+};
+
+// surfaces still pending when the waiter goes away are never produced
+std::shared_ptr<IFenceWaiter> create_fence_waiter(
+	std::shared_ptr<ISurfaceQueue> const& queue);
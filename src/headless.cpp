@@ -0,0 +1,641 @@
+// Copyright (c) 2018 Daktronics. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+#include "headless.h"
+#include "util.h"
+#include "clock.h"
+#include "channels.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <atomic>
+
+using namespace std;
+
+namespace {
+
+	//
+	// counts the surfaces a queue allocates (and lets go of) as it
+	// follows demand
+	//
+	class CountingAllocator : public ISurfaceAllocator
+	{
+	private:
+		shared_ptr<ISurfaceAllocator> const inner_;
+		uint64_t const bytes_per_surface_;
+		atomic<uint64_t> allocated_;
+		atomic<uint64_t> released_;
+		atomic<uint64_t> peak_;
+
+	public:
+		CountingAllocator(shared_ptr<ISurfaceAllocator> const& inner,
+				uint32_t width, uint32_t height)
+			: inner_(inner)
+			, bytes_per_surface_(uint64_t(width) * height * 4)
+			, allocated_(0)
+			, released_(0)
+			, peak_(0) {
+		}
+
+		shared_ptr<ISurface> allocate() override
+		{
+			auto const surface = inner_->allocate();
+			if (surface)
+			{
+				auto const live = ++allocated_ - released_;
+				if (live > peak_) {
+					peak_ = live;
+				}
+			}
+			return surface;
+		}
+
+		void release(shared_ptr<ISurface> const& surface) override
+		{
+			++released_;
+			inner_->release(surface);
+		}
+
+		uint64_t allocated() const { return allocated_; }
+		uint64_t released() const { return released_; }
+		uint64_t peak() const { return peak_; }
+		uint64_t bytes() const { return allocated_ * bytes_per_surface_; }
+	};
+
+	//
+	// time (ms) between the frames the first consumer presents
+	//
+	class FrameTimes
+	{
+	private:
+		vector<double> samples_;
+		uint64_t last_;
+
+	public:
+		FrameTimes()
+			: last_(0) {
+		}
+
+		void presented()
+		{
+			auto const now = time_now();
+			if (last_) {
+				samples_.push_back((now - last_) / 1000.0);
+			}
+			last_ = now;
+		}
+
+		vector<double> const& samples() const { return samples_; }
+	};
+
+	void run_sync(HeadlessOptions const& options, Clock const& clock,
+		shared_ptr<IScene> const& producer, vector<shared_ptr<IScene>> const& consumers,
+		FrameTimes& times, vector<ThreadReport>& reports)
+	{
+		auto const& placement = options.placement;
+		set_thread_placement(placement.resolve(placement.consumer));
+
+		trace_thread_name("sync");
+		ThreadMonitor monitor("sync");
+		FrameScheduler scheduler(options.hz);
+
+		for (uint32_t n = 0; n < options.frames; ++n)
+		{
+			scheduler.wait();
+
+			auto const t = clock.tick_time(n);
+			producer->tick(t);
+			producer->render();
+
+			for (auto const& consumer : consumers)
+			{
+				consumer->tick(t);
+				consumer->render();
+			}
+
+			producer->present(0);
+			for (auto const& consumer : consumers) {
+				consumer->present(scheduler.rate() > 0.0 ? 1 : 0);
+			}
+			times.presented();
+			monitor.frame();
+		}
+		reports.push_back(monitor.report());
+	}
+
+	void run_threaded(HeadlessOptions const& options, Clock const& clock,
+		shared_ptr<IScene> const& producer, vector<shared_ptr<IScene>> const& consumers,
+		FrameTimes& times, vector<ThreadReport>& reports)
+	{
+		atomic_bool done(false);
+		auto const& placement = options.placement;
+
+		// a slot per thread ... each fills in its own as it finishes
+		reports.resize(1 + consumers.size());
+
+		vector<thread> threads;
+
+		// the producer is paced against the consumers' presents when they
+		// run at a fixed rate ... otherwise it goes flat out
+		threads.push_back(thread([&]()
+		{
+			set_thread_placement(placement.resolve(placement.producer));
+
+			trace_thread_name("producer");
+			ThreadMonitor monitor("producer");
+			ProducerPacer pacer;
+			for (int64_t n = 0; !done; ++n)
+			{
+				if (options.hz > 0.0) {
+					pacer.begin(producer->queue()->consumer_timing());
+				}
+
+				producer->tick(clock.tick_time(n));
+				producer->render();
+				producer->present(0);
+
+				if (options.hz > 0.0) {
+					pacer.end();
+				}
+				monitor.frame();
+			}
+			reports[0] = monitor.report();
+		}));
+
+		// the first consumer decides when we're done
+		for (size_t c = 0; c < consumers.size(); ++c)
+		{
+			threads.push_back(thread([&, c]()
+			{
+				set_thread_placement(placement.resolve(placement.consumer));
+
+				auto const name = "consumer " + to_string(c);
+				trace_thread_name(name);
+				ThreadMonitor monitor(name);
+				FrameScheduler scheduler(options.hz);
+				auto const& consumer = consumers[c];
+				for (uint32_t n = 0; !done && (c || n < options.frames); ++n)
+				{
+					scheduler.wait();
+
+					consumer->tick(clock.tick_time(n));
+					consumer->render();
+					consumer->present(scheduler.rate() > 0.0 ? 1 : 0);
+
+					if (!c) {
+						times.presented();
+					}
+					monitor.frame();
+				}
+				reports[1 + c] = monitor.report();
+
+				if (!c)
+				{
+					// wake anyone blocked in checkout()/consume()
+					done = true;
+					producer->queue()->close();
+					for (auto const& other : consumers) {
+						other->queue()->close();
+					}
+				}
+			}));
+		}
+
+		for (auto& t : threads) {
+			t.join();
+		}
+	}
+
+	struct ChannelRun
+	{
+		uint32_t channels = 0;
+		uint32_t threads = 0;
+		uint64_t elapsed = 0;
+		vector<ChannelStats> stats;
+
+		// the thread stepping the channels (the workers aren't watched)
+		ThreadReport stepper;
+
+		// frames per second across every channel
+		double fps() const
+		{
+			uint64_t frames = 0;
+			for (auto const& s : stats) {
+				frames += s.frames;
+			}
+			return elapsed ? (frames * 1000000.0 / elapsed) : 0.0;
+		}
+	};
+
+	ChannelRun run_channels(HeadlessOptions const& options,
+		shared_ptr<IJobSystem> const& jobs, uint32_t channels)
+	{
+		ChannelRun run;
+
+		auto const manager = create_channel_manager(jobs);
+		if (!manager) {
+			return run;
+		}
+
+		auto queue_options = options.queue;
+		queue_options.fanout = (options.outputs > 1);
+
+		for (uint32_t n = 0; n < channels; ++n)
+		{
+			auto const producer = create_cpu_producer(
+				options.width, options.height, queue_options);
+			if (!producer) {
+				continue;
+			}
+
+			vector<shared_ptr<IScene>> consumers;
+			for (uint32_t c = 0; c < max(options.outputs, 1u); ++c) {
+				consumers.push_back(create_cpu_consumer(producer));
+			}
+			manager->add(producer, consumers);
+		}
+
+		Clock clock;
+		clock.set_fixed_step(options.fixed_step);
+		FrameScheduler scheduler(options.hz);
+		trace_thread_name("channels");
+		ThreadMonitor monitor("channels");
+
+		auto const start = time_now();
+		clock.start();
+		for (uint32_t n = 0; n < options.frames; ++n)
+		{
+			scheduler.wait();
+			manager->step(clock.tick_time(n), scheduler.rate() > 0.0 ? 1 : 0);
+			monitor.frame();
+		}
+
+		run.elapsed = time_now() - start;
+		run.channels = static_cast<uint32_t>(manager->channels());
+		run.threads = manager->threads();
+		run.stats = manager->stats();
+		run.stepper = monitor.report();
+		return run;
+	}
+
+	const char* to_string(SurfaceQueueType type)
+	{
+		switch (type)
+		{
+			case SurfaceQueueType::ring: return "ring";
+			case SurfaceQueueType::locked:
+			default: return "locked";
+		}
+	}
+
+	const char* to_string(SurfaceDelivery delivery)
+	{
+		switch (delivery)
+		{
+			case SurfaceDelivery::mailbox: return "mailbox";
+			case SurfaceDelivery::fifo:
+			default: return "fifo";
+		}
+	}
+
+	string to_json(vector<double> const& samples)
+	{
+		auto mean = 0.0;
+		for (auto const s : samples) {
+			mean += s;
+		}
+		mean = samples.empty() ? 0.0 : (mean / samples.size());
+
+		ostringstream out;
+		out << "{ \"mean\": " << mean
+			<< ", \"p50\": " << percentile(samples, 0.50)
+			<< ", \"p95\": " << percentile(samples, 0.95)
+			<< ", \"p99\": " << percentile(samples, 0.99)
+			<< ", \"max\": " << (samples.empty() ? 0.0 :
+				*max_element(samples.begin(), samples.end()))
+			<< " }";
+		return out.str();
+	}
+
+	// percentiles are bucket upper bounds (see Histogram)
+	string to_json(Histogram const& h)
+	{
+		ostringstream out;
+		out << "{ \"count\": " << h.count
+			<< ", \"mean\": " << h.mean()
+			<< ", \"p50\": " << h.percentile(0.50)
+			<< ", \"p99\": " << h.percentile(0.99)
+			<< ", \"max\": " << h.max
+			<< " }";
+		return out.str();
+	}
+
+	// count, mean and max are over the whole run ... the percentiles are
+	// over the most recent window of samples
+	string to_json(SampleWindow const& w)
+	{
+		ostringstream out;
+		out << "{ \"count\": " << w.count
+			<< ", \"mean\": " << w.mean()
+			<< ", \"max\": " << w.max
+			<< ", \"window\": { \"count\": " << w.samples.size()
+			<< ", \"p50\": " << percentile(w.samples, 0.50)
+			<< ", \"p99\": " << percentile(w.samples, 0.99)
+			<< " } }";
+		return out.str();
+	}
+
+	string to_json(ConsumerStats const& stats)
+	{
+		ostringstream out;
+		out << "{ \"presented\": " << stats.presented
+			<< ", \"received\": " << stats.received
+			<< ", \"repeated\": " << stats.repeated
+			<< ", \"dropped\": " << stats.dropped
+			<< ", \"interval_us\": " << to_json(stats.interval)
+			<< ", \"consume_us\": " << to_json(stats.consume)
+			<< ", \"copy_us\": " << to_json(stats.copy)
+			<< ", \"present_us\": " << to_json(stats.present)
+			<< " }";
+		return out.str();
+	}
+
+	string to_json(ThreadReport const& report)
+	{
+		ostringstream out;
+		out << "{ \"name\": \"" << report.name << "\""
+			<< ", \"available\": " << (report.available ? "true" : "false")
+			<< ", \"frames\": " << report.frames
+			<< ", \"preempted\": " << report.switches
+			<< ", \"preempted_per_frame\": " << to_json(report.switches_per_frame)
+			<< ", \"run_delay_us\": " << to_json(report.delay_per_frame)
+			<< " }";
+		return out.str();
+	}
+
+	string to_json(vector<ThreadReport> const& reports, string const& indent)
+	{
+		ostringstream out;
+		out << "[\n";
+		for (size_t n = 0; n < reports.size(); ++n)
+		{
+			out << indent << "  " << to_json(reports[n])
+				<< ((n + 1 < reports.size()) ? ",\n" : "\n");
+		}
+		out << indent << "]";
+		return out.str();
+	}
+}
+
+namespace {
+
+	//
+	// N channels on one job system ... with scaling, 1, 2, 4 ... up to N,
+	// to show how aggregate throughput grows with the channel count
+	//
+	string run_headless_channels(HeadlessOptions const& options)
+	{
+		auto const& placement = options.placement;
+		auto const jobs = create_job_system(
+			options.threads, placement.resolve(placement.workers));
+
+		// we run channels too while we wait for a step
+		set_thread_placement(placement.resolve(placement.workers));
+
+		// scaling defaults to 64 channels
+		auto const channels = options.channels ? options.channels : 64u;
+
+		vector<uint32_t> counts;
+		if (options.scaling)
+		{
+			for (uint32_t n = 1; n < channels; n *= 2) {
+				counts.push_back(n);
+			}
+		}
+		counts.push_back(channels);
+
+		vector<ChannelRun> runs;
+		for (auto const n : counts) {
+			runs.push_back(run_channels(options, jobs, n));
+		}
+
+		ostringstream out;
+		out << "{\n"
+			<< "  \"pipeline\": \"channels\",\n"
+			<< "  \"queue_type\": \"" << to_string(options.queue.type) << "\",\n"
+			<< "  \"delivery\": \"" << to_string(options.queue.delivery) << "\",\n"
+			<< "  \"outputs\": " << max(options.outputs, 1u) << ",\n"
+			<< "  \"width\": " << options.width << ",\n"
+			<< "  \"height\": " << options.height << ",\n"
+			<< "  \"hz\": " << options.hz << ",\n"
+			<< "  \"fixed_step_ns\": " << options.fixed_step << ",\n"
+			<< "  \"frames\": " << options.frames << ",\n"
+			<< "  \"threads\": " << jobs->threads() << ",\n"
+			<< "  \"runs\": [\n";
+
+		auto const base = runs.front().channels ?
+			(runs.front().fps() / runs.front().channels) : 0.0;
+		for (size_t r = 0; r < runs.size(); ++r)
+		{
+			auto const& run = runs[r];
+			auto const fps = run.fps();
+
+			Histogram busy;
+			uint64_t dropped = 0;
+			for (auto const& s : run.stats)
+			{
+				busy.add(s.busy);
+				dropped += s.queue.dropped;
+			}
+
+			out << "    {\n"
+				<< "      \"channels\": " << run.channels << ",\n"
+				<< "      \"elapsed_ms\": " << (run.elapsed / 1000.0) << ",\n"
+				<< "      \"fps\": " << fps << ",\n"
+				<< "      \"channel_fps\": " << (run.channels ? (fps / run.channels) : 0.0) << ",\n";
+
+			// against the single channel run on the same pool
+			if (options.scaling) {
+				out << "      \"speedup\": " << (base > 0.0 ? (fps / base) : 0.0) << ",\n";
+			}
+
+			out << "      \"dropped\": " << dropped << ",\n"
+				<< "      \"busy_us\": " << to_json(busy) << ",\n"
+				<< "      \"threads\": " << to_json(vector<ThreadReport>(1, run.stepper), "      ");
+
+			// per channel detail only for a single run ... it's a lot of
+			// output for 64 channels
+			if (!options.scaling)
+			{
+				out << ",\n      \"per_channel\": [\n";
+				for (size_t c = 0; c < run.stats.size(); ++c)
+				{
+					auto const& s = run.stats[c];
+					out << "        { \"id\": " << s.id
+						<< ", \"frames\": " << s.frames
+						<< ", \"fps\": " << (run.elapsed ? (s.frames * 1000000.0 / run.elapsed) : 0.0)
+						<< ", \"dropped\": " << s.queue.dropped
+						<< ", \"busy_us\": " << to_json(s.busy) << " }"
+						<< ((c + 1 < run.stats.size()) ? ",\n" : "\n");
+				}
+				out << "      ]";
+			}
+			out << "\n    }" << ((r + 1 < runs.size()) ? ",\n" : "\n");
+		}
+		out << "  ]\n"
+			<< "}\n";
+		return out.str();
+	}
+
+	//
+	// the producer -> queue -> consumer(s) pipeline
+	//
+	string run_headless_pipeline(HeadlessOptions const& options)
+	{
+		auto const allocator = make_shared<CountingAllocator>(
+			create_cpu_surface_allocator(options.width, options.height),
+			options.width, options.height);
+
+		auto queue_options = options.queue;
+		queue_options.fanout = (options.outputs > 1);
+
+		auto const producer = create_cpu_producer(
+			options.width, options.height, queue_options, allocator);
+		if (!producer) {
+			return "{ \"error\": \"failed to create the producer\" }\n";
+		}
+
+		vector<shared_ptr<IScene>> consumers;
+		for (uint32_t n = 0; n < max(options.outputs, 1u); ++n) {
+			consumers.push_back(create_cpu_consumer(producer));
+		}
+
+		Clock clock;
+		clock.set_fixed_step(options.fixed_step);
+
+		FrameTimes times;
+		vector<ThreadReport> reports;
+		auto const start = time_now();
+		clock.start();
+		if (options.threaded) {
+			run_threaded(options, clock, producer, consumers, times, reports);
+		}
+		else {
+			run_sync(options, clock, producer, consumers, times, reports);
+		}
+		auto const elapsed = time_now() - start;
+
+		auto const stats = producer->queue()->stats();
+
+		ostringstream out;
+		out << "{\n"
+			<< "  \"pipeline\": \"" << (options.threaded ? "threaded" : "sync") << "\",\n"
+			<< "  \"queue_type\": \"" << to_string(options.queue.type) << "\",\n"
+			<< "  \"delivery\": \"" << to_string(options.queue.delivery) << "\",\n"
+			<< "  \"outputs\": " << consumers.size() << ",\n"
+			<< "  \"width\": " << options.width << ",\n"
+			<< "  \"height\": " << options.height << ",\n"
+			<< "  \"hz\": " << options.hz << ",\n"
+			<< "  \"fixed_step_ns\": " << options.fixed_step << ",\n"
+			<< "  \"frames\": " << options.frames << ",\n"
+			<< "  \"elapsed_ms\": " << (elapsed / 1000.0) << ",\n"
+			<< "  \"fps\": " << (elapsed ? (options.frames * 1000000.0 / elapsed) : 0.0) << ",\n"
+			<< "  \"frame_ms\": " << to_json(times.samples()) << ",\n"
+			<< "  \"produced\": " << stats.produced << ",\n"
+			<< "  \"consumed\": " << stats.consumed << ",\n"
+			<< "  \"dropped\": " << stats.dropped << ",\n"
+			<< "  \"late\": " << stats.late << ",\n"
+			<< "  \"checkout_timeouts\": " << stats.checkout_timeouts << ",\n"
+			<< "  \"consume_timeouts\": " << stats.consume_timeouts << ",\n"
+			<< "  \"checkout_wait_us\": " << to_json(stats.checkout_wait) << ",\n"
+			<< "  \"consume_wait_us\": " << to_json(stats.consume_wait) << ",\n"
+			<< "  \"allocations\": { \"surfaces\": " << allocator->allocated()
+				<< ", \"released\": " << allocator->released()
+				<< ", \"peak\": " << allocator->peak()
+				<< ", \"bytes\": " << allocator->bytes() << " },\n"
+			<< "  \"threads\": " << to_json(reports, "  ") << ",\n"
+			<< "  \"consumers\": [\n";
+
+		// what each output saw from its side of the queue
+		for (size_t n = 0; n < consumers.size(); ++n)
+		{
+			out << "    " << to_json(consumers[n]->consumer_stats())
+				<< ((n + 1 < consumers.size()) ? ",\n" : "\n");
+		}
+		out << "  ]\n"
+			<< "}\n";
+		return out.str();
+	}
+}
+
+string run_headless(HeadlessOptions const& options)
+{
+	trace_enable(!options.trace_file.empty());
+
+	auto const results = (options.channels || options.scaling) ?
+		run_headless_channels(options) : run_headless_pipeline(options);
+
+	if (trace_enabled())
+	{
+		trace_enable(false);
+		trace_save(options.trace_file);
+	}
+	return results;
+}
+
+bool parse_headless_option(string const& key, string const& value, HeadlessOptions& options)
+{
+	if (key == "frames") {
+		options.frames = max(to_int(value, options.frames), 1);
+	}
+	else if (key == "size")
+	{
+		// split on 'x' (eg. 1920x1080)
+		auto const c = value.find('x');
+		if (c != string::npos) {
+			options.width = max(to_int(value.substr(0, c), options.width), 1);
+			options.height = max(to_int(value.substr(c + 1), options.height), 1);
+		}
+	}
+	else if (key == "outputs") {
+		options.outputs = max(to_int(value, options.outputs), 1);
+	}
+	else if (key == "pipeline") {
+		options.threaded = (value == "threaded");
+	}
+	else if (key == "hz") {
+		options.hz = strtod(value.c_str(), nullptr);
+	}
+	else if (key == "fixed-step") {
+		options.fixed_step = to_step(strtod(value.c_str(), nullptr));
+	}
+	else if (key == "channels") {
+		options.channels = max(to_int(value, options.channels), 1);
+	}
+	else if (key == "scaling") {
+		options.scaling = true;
+	}
+	else if (key == "threads") {
+		options.threads = max(to_int(value, options.threads), 0);
+	}
+	else if (key == "trace") {
+		options.trace_file = value;
+	}
+	else if (key == "queue") {
+		options.queue.type = (value == "ring") ? SurfaceQueueType::ring : SurfaceQueueType::locked;
+	}
+	else if (key == "delivery") {
+		options.queue.delivery = (value == "mailbox") ? SurfaceDelivery::mailbox : SurfaceDelivery::fifo;
+	}
+	else {
+		return parse_thread_option(key, value, options.placement);
+	}
+	return true;
+}
@@ -0,0 +1,58 @@
+// Copyright (c) 2018 Daktronics. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include "scene.h"
+#include "placement.h"
+
+#include <string>
+
+struct HeadlessOptions
+{
+	// # of frames the (first) consumer renders before we stop
+	uint32_t frames = 600;
+
+	uint32_t width = 1280;
+	uint32_t height = 720;
+
+	// # of consumers fed by the producer (more than one fans out)
+	uint32_t outputs = 1;
+
+	// run the producer and each consumer on their own threads
+	bool threaded = false;
+
+	// consumer rate (0 = as fast as the pipeline goes)
+	double hz = 0.0;
+
+	// ns the scene time advances per tick (0 = follow the wall clock)
+	int64_t fixed_step = 0;
+
+	SurfaceQueueOptions queue;
+
+	// run this many independent producer/consumer pipelines on a channel
+	// manager (0 = the single pipeline above) ... with scaling, every power
+	// of two up to it is run in turn
+	uint32_t channels = 0;
+	bool scaling = false;
+
+	// job system threads for channels (0 = one per core)
+	uint32_t threads = 0;
+
+	// where the producer, consumer and worker threads run
+	ThreadSettings placement;
+
+	// write the run's trace zones here as Chrome trace json
+	std::string trace_file;
+};
+
+//
+// runs the producer -> queue -> consumer(s) pipeline on the cpu backend,
+// without windows or a gpu ... returns the results as json
+//
+std::string run_headless(HeadlessOptions const&);
+
+// applies a --key=value command line option ... false if it isn't ours
+bool parse_headless_option(
+	std::string const& key, std::string const& value, HeadlessOptions&);
@@ -0,0 +1,70 @@
+// Copyright (c) 2018 Daktronics. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+//
+// console entry point for headless runs (the same as the application's
+// --headless mode) ... for example:
+//
+//   d3d-9211-headless --frames=1000 --pipeline=threaded --outputs=2
+//   d3d-9211-headless --frames=300 --channels=64 --scaling
+//
+// the results go to stdout as json, or to --out=<file>
+//
+
+#include "headless.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <fstream>
+
+using namespace std;
+
+int main(int argc, char* argv[])
+{
+	HeadlessOptions options;
+	string out_file;
+
+	for (int n = 1; n < argc; ++n)
+	{
+		string option(argv[n]);
+		if (option.substr(0, 2) != "--") {
+			continue;
+		}
+		option = option.substr(2);
+
+		string key, value;
+		auto const eq = option.find('=');
+		if (eq != string::npos)
+		{
+			key = option.substr(0, eq);
+			value = option.substr(eq + 1);
+		}
+		else {
+			key = option;
+		}
+
+		if (key == "out") {
+			out_file = value;
+		}
+		else if (!parse_headless_option(key, value, options) && key != "headless") {
+			fprintf(stderr, "unknown option --%s\n", key.c_str());
+		}
+	}
+
+	auto const results = run_headless(options);
+	if (out_file.empty()) {
+		fputs(results.c_str(), stdout);
+	}
+	else
+	{
+		ofstream file(out_file);
+		file << results;
+		if (!file) {
+			fprintf(stderr, "failed to write '%s'\n", out_file.c_str());
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,803 @@
+// Copyright (c) 2018 Daktronics. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+#include "platform.h"
+#include "scene.h"
+#include "util.h"
+#include "trace.h"
+
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+
+using namespace std;
+
+namespace {
+
+	uint32_t const shared_magic = 0x71643364; // 'd3dq'
+	uint32_t const max_slots = 8;
+
+	//
+	// where a slot's surface is in its trip around the queue
+	//
+	enum SlotState : uint32_t
+	{
+		slot_empty = 0,   // no surface (yet) for this generation
+		slot_free,        // in the pool
+		slot_producing,   // checked out by the producer
+		slot_due,         // produced ... waiting for the consumer
+		slot_consuming    // consumed ... waiting to be checked in
+	};
+
+	//
+	// the state word carries the producer generation in the upper half ...
+	// any transition made against a stale generation (eg. a checkin of a
+	// surface from before a producer restart) fails its compare-exchange
+	//
+	inline LONG64 pack(uint32_t generation, uint32_t state) {
+		return static_cast<LONG64>((uint64_t(generation) << 32) | state);
+	}
+
+	//
+	// everything in the file mapping ... the surfaces themselves are D3D9Ex
+	// shared textures so only their share handles cross the process boundary
+	//
+	struct SharedSlot
+	{
+		volatile LONG64 state;
+
+		// only written by the producer while the slot is empty
+		uint64_t share_handle;
+		uint32_t width;
+		uint32_t height;
+
+		// written by the producer before the slot becomes due
+		LONG64 sequence;
+		FrameInfo info;
+	};
+
+	struct SharedHeader
+	{
+		uint32_t magic;
+		volatile LONG generation;
+
+		// process currently consuming ... 0 for none
+		volatile LONG consumer_pid;
+
+		// consumer's vblank timing (see ConsumerTiming) ... time_now() is
+		// the performance counter, which every process shares
+		volatile LONG64 vblank_period;
+		volatile LONG64 vblank_last;
+		volatile LONG64 sequence;
+		SharedSlot slots[max_slots];
+	};
+
+	HANDLE create_named_event(wstring const& name)
+	{
+		return CreateEventW(nullptr, FALSE, FALSE, name.c_str());
+	}
+
+	//
+	// a named mutex held for as long as this process plays a role ...
+	// returns nullptr if someone else already holds it
+	//
+	HANDLE acquire_role(wstring const& name)
+	{
+		auto const mutex = CreateMutexW(nullptr, FALSE, name.c_str());
+		if (mutex)
+		{
+			// abandoned = the previous holder died without letting go
+			auto const result = WaitForSingleObject(mutex, 0);
+			if (result == WAIT_OBJECT_0 || result == WAIT_ABANDONED) {
+				return mutex;
+			}
+			CloseHandle(mutex);
+		}
+		return nullptr;
+	}
+
+	//
+	// the consumer's view of a producer surface
+	//
+	class RemoteSurface : public ISurface
+	{
+	private:
+		uint32_t const slot_;
+		uint32_t const generation_;
+		uint32_t const width_;
+		uint32_t const height_;
+		void* const share_handle_;
+
+	public:
+		RemoteSurface(
+			uint32_t slot,
+			uint32_t generation,
+			uint32_t width,
+			uint32_t height,
+			void* share_handle)
+			: slot_(slot)
+			, generation_(generation)
+			, width_(width)
+			, height_(height)
+			, share_handle_(share_handle) {
+		}
+
+		uint32_t slot() const { return slot_; }
+		uint32_t generation() const { return generation_; }
+
+		uint32_t width() const override { return width_; }
+		uint32_t height() const override { return height_; }
+		void* share_handle() const override { return share_handle_; }
+	};
+
+	//
+	// one end of a surface queue that lives in a named file mapping
+	//
+	// there is no ring as such ... each slot has a state word and the
+	// consumer takes the due slot with the lowest sequence, which keeps
+	// every transition a single compare-exchange and lets either side
+	// reclaim slots after the other one dies
+	//
+	class SharedSurfaceQueue
+		: public ISurfaceQueue
+		, public enable_shared_from_this<SharedSurfaceQueue>
+	{
+	private:
+		SurfaceQueueRole const role_;
+		HANDLE mapping_;
+		SharedHeader* header_;
+
+		// held for as long as we play our role
+		HANDLE role_mutex_;
+
+		// producer: the consumer's process ... to notice it going away
+		HANDLE consumer_process_;
+		DWORD consumer_pid_;
+
+		// due = produced a surface, pool = checked one in ... the watch
+		// events feed the signal so they don't steal wake-ups from waiters
+		HANDLE due_event_;
+		HANDLE pool_event_;
+		HANDLE due_watch_;
+		HANDLE pool_watch_;
+
+		// local only ... wakes our waiters on close()
+		HANDLE close_event_;
+		atomic_bool closed_;
+
+		// producer: our surfaces by slot for the current generation
+		// consumer: views of the producer's surfaces by slot
+		shared_ptr<ISurface> surfaces_[max_slots];
+		uint32_t generation_;
+
+		function<void()> signal_;
+		mutex signal_lock_;
+		thread watcher_;
+
+		// consumer: high priority surfaces taken in a row
+		uint32_t const priority_burst_;
+		uint32_t run_;
+
+		atomic<uint64_t> produced_;
+		atomic<uint64_t> consumed_;
+		atomic<uint64_t> lane_produced_[surface_priorities];
+		atomic<uint64_t> lane_consumed_[surface_priorities];
+		atomic<uint64_t> on_time_;
+		atomic<uint64_t> late_;
+		atomic<uint64_t> checkout_timeouts_;
+		atomic<uint64_t> consume_timeouts_;
+
+	public:
+		SharedSurfaceQueue(SurfaceQueueRole role, uint32_t priority_burst)
+			: role_(role)
+			, mapping_(nullptr)
+			, header_(nullptr)
+			, role_mutex_(nullptr)
+			, consumer_process_(nullptr)
+			, consumer_pid_(0)
+			, due_event_(nullptr)
+			, pool_event_(nullptr)
+			, due_watch_(nullptr)
+			, pool_watch_(nullptr)
+			, close_event_(CreateEventW(nullptr, TRUE, FALSE, nullptr))
+			, closed_(false)
+			, generation_(0)
+			, priority_burst_(max(priority_burst, 1u))
+			, run_(0)
+			, produced_(0)
+			, consumed_(0)
+			, on_time_(0)
+			, late_(0)
+			, checkout_timeouts_(0)
+			, consume_timeouts_(0)
+		{
+			for (size_t n = 0; n < surface_priorities; ++n) {
+				lane_produced_[n] = 0;
+				lane_consumed_[n] = 0;
+			}
+		}
+
+		~SharedSurfaceQueue()
+		{
+			close();
+			if (watcher_.joinable()) {
+				watcher_.join();
+			}
+
+			// leave nothing behind for the consumer to open once our
+			// textures are gone
+			if (header_ && role_ == SurfaceQueueRole::producer) {
+				reset(InterlockedIncrement(&header_->generation));
+			}
+
+			if (header_ && role_ == SurfaceQueueRole::consumer) {
+				InterlockedCompareExchange(
+					&header_->consumer_pid, 0, static_cast<LONG>(GetCurrentProcessId()));
+			}
+
+			for (auto& s : surfaces_) {
+				s.reset();
+			}
+
+			if (header_) {
+				UnmapViewOfFile(header_);
+			}
+
+			if (role_mutex_) {
+				ReleaseMutex(role_mutex_);
+			}
+
+			HANDLE const handles[] = { mapping_, role_mutex_, consumer_process_,
+				due_event_, pool_event_, due_watch_, pool_watch_, close_event_ };
+			for (auto const h : handles)
+			{
+				if (h) {
+					CloseHandle(h);
+				}
+			}
+		}
+
+		bool open(string const& name)
+		{
+			auto const base = to_utf16("Local\\d3d-9211-" + name);
+
+			role_mutex_ = acquire_role(base +
+				(role_ == SurfaceQueueRole::producer ? L"-producer" : L"-consumer"));
+			if (!role_mutex_)
+			{
+				log_message("surface queue '%s' already has a %s\n", name.c_str(),
+					role_ == SurfaceQueueRole::producer ? "producer" : "consumer");
+				return false;
+			}
+
+			mapping_ = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr,
+				PAGE_READWRITE, 0, sizeof(SharedHeader), (base + L"-memory").c_str());
+			if (!mapping_) {
+				log_message("failed to create shared memory for '%s'\n", name.c_str());
+				return false;
+			}
+
+			header_ = static_cast<SharedHeader*>(MapViewOfFile(
+				mapping_, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(SharedHeader)));
+			if (!header_) {
+				return false;
+			}
+
+			due_event_ = create_named_event(base + L"-due");
+			pool_event_ = create_named_event(base + L"-pool");
+			due_watch_ = create_named_event(base + L"-due-watch");
+			pool_watch_ = create_named_event(base + L"-pool-watch");
+			if (!due_event_ || !pool_event_ || !due_watch_ || !pool_watch_) {
+				return false;
+			}
+
+			// a new mapping is zero-filled ... whoever gets here first stamps it
+			InterlockedCompareExchange(
+				reinterpret_cast<volatile LONG*>(&header_->magic), shared_magic, 0);
+			if (header_->magic != shared_magic) {
+				log_message("'%s' is not a surface queue\n", name.c_str());
+				return false;
+			}
+
+			// a (re)started producer takes over every slot
+			if (role_ == SurfaceQueueRole::producer)
+			{
+				generation_ = InterlockedIncrement(&header_->generation);
+				reset(generation_);
+				notify(due_event_, due_watch_);
+			}
+			else 
+			{
+				InterlockedExchange(
+					&header_->consumer_pid, static_cast<LONG>(GetCurrentProcessId()));
+				reclaim_from_previous_consumer();
+			}
+			return true;
+		}
+
+		//
+		// producer: make one of our surfaces available through the queue
+		//
+		bool publish(shared_ptr<ISurface> const& surface)
+		{
+			for (uint32_t n = 0; n < max_slots; ++n)
+			{
+				auto& slot = header_->slots[n];
+				if (surfaces_[n] || slot.state != pack(generation_, slot_empty)) {
+					continue;
+				}
+
+				slot.share_handle = reinterpret_cast<uint64_t>(surface->share_handle());
+				slot.width = surface->width();
+				slot.height = surface->height();
+				surfaces_[n] = surface;
+
+				InterlockedExchange64(&slot.state, pack(generation_, slot_free));
+				return true;
+			}
+			return false;
+		}
+
+		shared_ptr<ISurface> checkout(uint32_t timeout_ms) override
+		{
+			TRACE_ZONE("checkout");
+			auto const surface = wait(pool_event_, timeout_ms, [this]() {
+				return try_checkout();
+			});
+			if (!surface && !closed_) {
+				++checkout_timeouts_;
+			}
+			return surface;
+		}
+
+		void produce(shared_ptr<ISurface> const& surface, 
+			SurfacePriority priority) override
+		{
+			auto const n = slot_of(surface);
+			if (n >= max_slots) {
+				return;
+			}
+
+			auto& slot = header_->slots[n];
+
+			auto info = surface->frame_info();
+			info.produced = time_now();
+			info.priority = priority;
+			surface->set_frame_info(info);
+			slot.info = info;
+			slot.sequence = InterlockedIncrement64(&header_->sequence);
+
+			if (transition(n, generation_, slot_producing, slot_due)) {
+				++produced_;
+				++lane_produced_[static_cast<size_t>(priority)];
+				notify(due_event_, due_watch_);
+			}
+		}
+
+		shared_ptr<ISurface> consume(uint32_t timeout_ms) override
+		{
+			TRACE_ZONE("consume");
+			auto const surface = wait(due_event_, timeout_ms, [this]() {
+				return try_consume();
+			});
+			if (!surface && !closed_) {
+				++consume_timeouts_;
+			}
+			return surface;
+		}
+
+		void checkin(shared_ptr<ISurface> const& surface) override
+		{
+			if (!surface || !header_) {
+				return;
+			}
+
+			if (role_ == SurfaceQueueRole::producer)
+			{
+				// a checked out surface that was never produced ... or one
+				// we haven't shared yet
+				auto const n = slot_of(surface);
+				if (n < max_slots) {
+					transition(n, generation_, slot_producing, slot_free);
+				}
+				else if (!publish(surface)) {
+					log_message("no free slot for a shared surface\n");
+				}
+				return;
+			}
+
+			auto const remote = dynamic_cast<RemoteSurface*>(surface.get());
+			if (remote && transition(
+				remote->slot(), remote->generation(), slot_consuming, slot_free))
+			{
+				notify(pool_event_, pool_watch_);
+			}
+		}
+
+		shared_ptr<ISurface> try_checkout() override
+		{
+			if (closed_ || role_ != SurfaceQueueRole::producer) {
+				return nullptr;
+			}
+
+			// a consumer that went away can't give back what it was holding
+			// ... so take a second look after reclaiming anything it had
+			for (uint32_t attempt = 0; attempt < 2; ++attempt)
+			{
+				for (uint32_t n = 0; n < max_slots; ++n)
+				{
+					if (transition(n, generation_, slot_free, slot_producing)) {
+						return surfaces_[n];
+					}
+				}
+
+				if (!reclaim_from_consumer()) {
+					break;
+				}
+			}
+			return nullptr;
+		}
+
+		shared_ptr<ISurface> try_consume() override
+		{
+			if (closed_ || role_ != SurfaceQueueRole::consumer) {
+				return nullptr;
+			}
+
+			for (;;)
+			{
+				auto const generation = static_cast<uint32_t>(header_->generation);
+
+				// oldest due surface of each priority
+				uint32_t oldest[surface_priorities];
+				fill(begin(oldest), end(oldest), max_slots);
+				for (uint32_t n = 0; n < max_slots; ++n)
+				{
+					auto const& slot = header_->slots[n];
+					if (slot.state != pack(generation, slot_due)) {
+						continue;
+					}
+
+					auto& o = oldest[(slot.info.priority == SurfacePriority::high) ? 1 : 0];
+					if (o == max_slots || slot.sequence < header_->slots[o].sequence) {
+						o = n;
+					}
+				}
+
+				// high priority first ... but not forever (see priority_burst)
+				auto const high = oldest[static_cast<size_t>(SurfacePriority::high)];
+				auto const normal = oldest[static_cast<size_t>(SurfacePriority::normal)];
+				auto const take_high = (high != max_slots) &&
+					(run_ < priority_burst_ || normal == max_slots);
+				auto const pick = take_high ? high : normal;
+				if (pick == max_slots) {
+					return nullptr;
+				}
+
+				if (!transition(pick, generation, slot_due, slot_consuming)) {
+					continue; // the producer restarted under us
+				}
+
+				auto const surface = view_of(pick, generation);
+				if (surface) 
+				{
+					run_ = take_high ? (run_ + 1) : 0;
+					auto const& info = surface->frame_info();
+					if (info.deadline) {
+						++((info.deadline < time_now()) ? late_ : on_time_);
+					}
+					++consumed_;
+					++lane_consumed_[static_cast<size_t>(info.priority)];
+					return surface;
+				}
+			}
+		}
+
+		vector<shared_ptr<ISurface>> drain() override
+		{
+			vector<shared_ptr<ISurface>> surfaces;
+			for (auto s = try_consume(); s; s = try_consume()) {
+				surfaces.push_back(s);
+			}
+			return surfaces;
+		}
+
+		void checkin(vector<shared_ptr<ISurface>> const& surfaces) override
+		{
+			for (auto const& s : surfaces) {
+				checkin(s);
+			}
+		}
+
+		//
+		// the other process makes surfaces available too ... so a watcher
+		// thread turns its events into calls to the signal
+		//
+		void set_signal(function<void()> const& callback) override
+		{
+			{
+				lock_guard<mutex> guard(signal_lock_);
+				signal_ = callback;
+			}
+
+			if (callback && !watcher_.joinable() && header_)
+			{
+				auto const event = (role_ == SurfaceQueueRole::producer) ?
+					pool_watch_ : due_watch_;
+				watcher_ = thread([this, event]() {
+					HANDLE const handles[] = { event, close_event_ };
+					while (WaitForMultipleObjects(2, handles, FALSE, INFINITE) == WAIT_OBJECT_0) {
+						fire();
+					}
+				});
+			}
+		}
+
+		void close() override
+		{
+			closed_ = true;
+			if (close_event_) {
+				SetEvent(close_event_);
+			}
+			fire();
+		}
+
+		bool is_closed() const override {
+			return closed_;
+		}
+
+		// one consumer per shared queue
+		shared_ptr<ISurfaceQueue> attach() override {
+			return shared_from_this();
+		}
+
+		void mark_vblank(uint64_t time) override
+		{
+			if (!header_ || role_ != SurfaceQueueRole::consumer) {
+				return;
+			}
+
+			auto const timing = consumer_timing().update(time);
+			InterlockedExchange64(&header_->vblank_period, static_cast<LONG64>(timing.period));
+			InterlockedExchange64(&header_->vblank_last, static_cast<LONG64>(timing.last));
+		}
+
+		ConsumerTiming consumer_timing() const override
+		{
+			ConsumerTiming timing;
+			if (header_)
+			{
+				timing.period = static_cast<uint64_t>(header_->vblank_period);
+				timing.last = static_cast<uint64_t>(header_->vblank_last);
+			}
+			return timing;
+		}
+
+		SurfaceQueueStats stats() const override
+		{
+			SurfaceQueueStats stats;
+			stats.produced = produced_;
+			stats.consumed = consumed_;
+			stats.on_time = on_time_;
+			stats.late = late_;
+			stats.checkout_timeouts = checkout_timeouts_;
+			stats.consume_timeouts = consume_timeouts_;
+			for (size_t n = 0; n < surface_priorities; ++n)
+			{
+				stats.lanes[n].produced = lane_produced_[n];
+				stats.lanes[n].consumed = lane_consumed_[n];
+			}
+			return stats;
+		}
+
+	private:
+
+		//
+		// retry until an attempt succeeds, we're closed or time is up ... the
+		// lane's event is auto-reset with one waiter per side, so a notify
+		// between our attempt and the wait is never lost
+		//
+		template <typename F>
+		shared_ptr<ISurface> wait(HANDLE event, uint32_t timeout_ms, F attempt)
+		{
+			auto const start = time_now();
+			for (;;)
+			{
+				auto const surface = attempt();
+				if (surface || closed_) {
+					return surface;
+				}
+
+				auto const elapsed_ms = static_cast<uint32_t>((time_now() - start) / 1000);
+				if (elapsed_ms >= timeout_ms) {
+					return nullptr;
+				}
+
+				HANDLE const handles[] = { event, close_event_ };
+				if (WaitForMultipleObjects(2, handles, FALSE,
+						timeout_ms - elapsed_ms) == WAIT_TIMEOUT) {
+					return attempt();
+				}
+			}
+		}
+
+		bool transition(uint32_t n, uint32_t generation, uint32_t from, uint32_t to)
+		{
+			if (n >= max_slots || !header_) {
+				return false;
+			}
+			auto const expected = pack(generation, from);
+			return InterlockedCompareExchange64(&header_->slots[n].state,
+				pack(generation, to), expected) == expected;
+		}
+
+		void notify(HANDLE event, HANDLE watch)
+		{
+			SetEvent(event);
+			SetEvent(watch);
+			fire();
+		}
+
+		void fire()
+		{
+			function<void()> callback;
+			{
+				lock_guard<mutex> guard(signal_lock_);
+				callback = signal_;
+			}
+			if (callback) {
+				callback();
+			}
+		}
+
+		uint32_t slot_of(shared_ptr<ISurface> const& surface) const
+		{
+			for (uint32_t n = 0; n < max_slots; ++n)
+			{
+				if (surface && surfaces_[n] == surface) {
+					return n;
+				}
+			}
+			return max_slots;
+		}
+
+		//
+		// producer: empty every slot for a new generation
+		//
+		void reset(uint32_t generation)
+		{
+			for (auto& slot : header_->slots) {
+				InterlockedExchange64(&slot.state, pack(generation, slot_empty));
+			}
+		}
+
+		//
+		// producer: is anyone (still) consuming?
+		//
+		bool consumer_alive()
+		{
+			auto const pid = static_cast<DWORD>(header_->consumer_pid);
+			if (!pid) {
+				return false;
+			}
+			if (pid == GetCurrentProcessId()) {
+				return true;
+			}
+
+			if (pid != consumer_pid_)
+			{
+				if (consumer_process_) {
+					CloseHandle(consumer_process_);
+				}
+				consumer_process_ = OpenProcess(SYNCHRONIZE, FALSE, pid);
+				consumer_pid_ = pid;
+			}
+
+			return consumer_process_ &&
+				(WaitForSingleObject(consumer_process_, 0) == WAIT_TIMEOUT);
+		}
+
+		//
+		// producer: if the consumer went away (or crashed), whatever it had
+		// consumed (or never got to) goes back to the pool
+		//
+		bool reclaim_from_consumer()
+		{
+			if (consumer_alive()) {
+				return false;
+			}
+
+			auto reclaimed = false;
+			for (uint32_t n = 0; n < max_slots; ++n)
+			{
+				if (transition(n, generation_, slot_consuming, slot_free) ||
+					transition(n, generation_, slot_due, slot_free)) {
+					reclaimed = true;
+				}
+			}
+			return reclaimed;
+		}
+
+		//
+		// consumer: we hold the consumer role, so anything still being
+		// consumed belongs to a consumer before us that died holding it ...
+		// the producer only reclaims while nobody consumes, which may never
+		// happen once we're registered
+		//
+		void reclaim_from_previous_consumer()
+		{
+			auto const generation = static_cast<uint32_t>(header_->generation);
+
+			auto reclaimed = false;
+			for (uint32_t n = 0; n < max_slots; ++n)
+			{
+				if (transition(n, generation, slot_consuming, slot_free)) {
+					reclaimed = true;
+				}
+			}
+
+			if (reclaimed) {
+				notify(pool_event_, pool_watch_);
+			}
+		}
+
+		//
+		// consumer: a (cached) view of the surface in a slot we now own
+		//
+		shared_ptr<ISurface> view_of(uint32_t n, uint32_t generation)
+		{
+			auto const& slot = header_->slots[n];
+			auto const handle = reinterpret_cast<void*>(slot.share_handle);
+			auto const width = slot.width;
+			auto const height = slot.height;
+			auto const info = slot.info;
+
+			// re-check we still own it ... a producer restarting while we
+			// read the slot may have re-used it
+			if (slot.state != pack(generation, slot_consuming)) {
+				return nullptr;
+			}
+
+			auto view = dynamic_pointer_cast<RemoteSurface>(surfaces_[n]);
+			if (!view || view->generation() != generation ||
+				view->share_handle() != handle)
+			{
+				view = make_shared<RemoteSurface>(n, generation, width, height, handle);
+				surfaces_[n] = view;
+			}
+
+			view->set_frame_info(info);
+			return view;
+		}
+	};
+}
+
+shared_ptr<ISurfaceQueue> create_shared_surface_queue(
+	string const& name,
+	SurfaceQueueRole role,
+	SurfaceQueueOptions const& options,
+	shared_ptr<ISurfaceAllocator> const& allocator)
+{
+	auto const queue = make_shared<SharedSurfaceQueue>(role, options.priority_burst);
+	if (!queue->open(name)) {
+		return nullptr;
+	}
+
+	// the producer shares a fixed set of surfaces ... the other process
+	// can't take part in growing or shrinking the pool
+	if (role == SurfaceQueueRole::producer && allocator)
+	{
+		auto const count = min(max(options.max_surfaces, 2u), max_slots);
+		for (uint32_t n = 0; n < count; ++n)
+		{
+			auto const surface = allocator->allocate();
+			if (!surface || !queue->publish(surface)) {
+				break;
+			}
+		}
+	}
+
+	return queue;
+}
@@ -0,0 +1,302 @@
+// Copyright (c) 2018 Daktronics. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+#include "jobs.h"
+#include "trace.h"
+
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+
+using namespace std;
+
+//
+// a job is queued once it has no unfinished dependencies ... pending
+// counts them (plus one held by run() until it has them all recorded)
+//
+struct JobState
+{
+	function<void()> callback;
+	atomic<uint32_t> pending;
+
+	// guards done and dependents, so a job can't finish while a new
+	// dependent is being recorded against it
+	mutex lock;
+	bool done;
+	vector<Job> dependents;
+
+	JobState(function<void()> const& cb)
+		: callback(cb)
+		, pending(1)
+		, done(false) {
+	}
+};
+
+namespace {
+
+	class JobSystem : public IJobSystem
+	{
+	private:
+		//
+		// the owning worker pushes and pops at the back, thieves take from
+		// the front ... short critical sections, so a mutex per deque
+		// is plenty for the handful of jobs in a frame
+		//
+		struct Worker
+		{
+			deque<Job> jobs;
+			mutex lock;
+		};
+
+		vector<unique_ptr<Worker>> workers_;
+		vector<thread> threads_;
+
+		// jobs queued from threads that aren't our workers
+		Worker shared_;
+
+		// # of jobs sitting in any deque ... workers and waiters park
+		// on signal_ while it's 0
+		atomic<uint32_t> queued_;
+		atomic<uint32_t> waiting_;
+		atomic_bool stop_;
+		condition_variable signal_;
+		mutex park_lock_;
+
+		// the worker (of which system) the current thread is
+		static thread_local JobSystem const* current_system_;
+		static thread_local size_t current_worker_;
+
+	public:
+		JobSystem(uint32_t threads, ThreadPlacement const& placement)
+			: queued_(0)
+			, waiting_(0)
+			, stop_(false)
+		{
+			for (uint32_t n = 0; n < max(threads, 1u); ++n) {
+				workers_.push_back(unique_ptr<Worker>(new Worker()));
+			}
+			for (size_t n = 0; n < workers_.size(); ++n) {
+				threads_.push_back(thread([this, n, placement]()
+				{
+					set_thread_placement(placement);
+					trace_thread_name("worker " + to_string(n));
+					work(n);
+				}));
+			}
+		}
+
+		~JobSystem()
+		{
+			{
+				lock_guard<mutex> guard(park_lock_);
+				stop_ = true;
+			}
+			signal_.notify_all();
+
+			for (auto& t : threads_) {
+				t.join();
+			}
+		}
+
+		Job run(function<void()> const& callback, vector<Job> const& after) override
+		{
+			auto const job = make_shared<JobState>(callback);
+			for (auto const& dep : after)
+			{
+				if (dep)
+				{
+					lock_guard<mutex> guard(dep->lock);
+					if (!dep->done)
+					{
+						++job->pending;
+						dep->dependents.push_back(job);
+					}
+				}
+			}
+
+			// release the hold from construction
+			if (--job->pending == 0) {
+				enqueue(job);
+			}
+			return job;
+		}
+
+		void wait(Job const& job) override
+		{
+			if (!job) {
+				return;
+			}
+
+			while (!done(job))
+			{
+				auto const next = dequeue(worker_index());
+				if (next) {
+					execute(next);
+					continue;
+				}
+
+				// nothing we can help with ... park until a job is queued
+				// or one finishes (the timeout guards a missed wake-up)
+				++waiting_;
+				{
+					unique_lock<mutex> lock(park_lock_);
+					signal_.wait_for(lock, chrono::milliseconds(1), [this, &job]() {
+						return queued_ > 0 || done(job);
+					});
+				}
+				--waiting_;
+			}
+		}
+
+		bool done(Job const& job) const override
+		{
+			if (!job) {
+				return true;
+			}
+			lock_guard<mutex> guard(job->lock);
+			return job->done;
+		}
+
+		uint32_t threads() const override {
+			return static_cast<uint32_t>(workers_.size());
+		}
+
+	private:
+
+		// our worker index for the current thread ... or workers_.size()
+		size_t worker_index() const {
+			return (current_system_ == this) ? current_worker_ : workers_.size();
+		}
+
+		void enqueue(Job const& job)
+		{
+			auto const index = worker_index();
+			auto& worker = (index < workers_.size()) ? *workers_[index] : shared_;
+			{
+				lock_guard<mutex> guard(worker.lock);
+				worker.jobs.push_back(job);
+			}
+			++queued_;
+
+			{
+				lock_guard<mutex> guard(park_lock_);
+			}
+			signal_.notify_one();
+		}
+
+		//
+		// our own newest job first (its data is likely still in cache), then
+		// the oldest from the shared deque, then the oldest from the others
+		//
+		Job dequeue(size_t index)
+		{
+			if (queued_ == 0) {
+				return nullptr;
+			}
+
+			Job job;
+			if (index < workers_.size()) {
+				job = take(*workers_[index], false);
+			}
+			if (!job) {
+				job = take(shared_, true);
+			}
+			for (size_t n = 1; !job && n <= workers_.size(); ++n) {
+				job = take(*workers_[(index + n) % workers_.size()], true);
+			}
+
+			if (job) {
+				--queued_;
+			}
+			return job;
+		}
+
+		static Job take(Worker& worker, bool front)
+		{
+			lock_guard<mutex> guard(worker.lock);
+			if (worker.jobs.empty()) {
+				return nullptr;
+			}
+
+			Job job;
+			if (front) {
+				job = move(worker.jobs.front());
+				worker.jobs.pop_front();
+			}
+			else {
+				job = move(worker.jobs.back());
+				worker.jobs.pop_back();
+			}
+			return job;
+		}
+
+		void execute(Job const& job)
+		{
+			if (job->callback) {
+				job->callback();
+			}
+
+			vector<Job> ready;
+			{
+				lock_guard<mutex> guard(job->lock);
+				job->done = true;
+				job->callback = nullptr;
+				ready.swap(job->dependents);
+			}
+
+			for (auto const& dep : ready)
+			{
+				if (--dep->pending == 0) {
+					enqueue(dep);
+				}
+			}
+
+			// someone may be parked in wait() on this job
+			if (waiting_ > 0)
+			{
+				{
+					lock_guard<mutex> guard(park_lock_);
+				}
+				signal_.notify_all();
+			}
+		}
+
+		void work(size_t index)
+		{
+			current_system_ = this;
+			current_worker_ = index;
+
+			while (!stop_)
+			{
+				auto const job = dequeue(index);
+				if (job) {
+					execute(job);
+					continue;
+				}
+
+				unique_lock<mutex> lock(park_lock_);
+				signal_.wait(lock, [this]() { return stop_ || queued_ > 0; });
+			}
+
+			current_system_ = nullptr;
+		}
+	};
+
+	thread_local JobSystem const* JobSystem::current_system_ = nullptr;
+	thread_local size_t JobSystem::current_worker_ = 0;
+}
+
+shared_ptr<IJobSystem> create_job_system(uint32_t threads, ThreadPlacement const& placement)
+{
+	if (!threads)
+	{
+		auto const cores = thread::hardware_concurrency();
+		threads = (cores > 1) ? (cores - 1) : 1;
+	}
+	return make_shared<JobSystem>(threads, placement);
+}
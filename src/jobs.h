@@ -0,0 +1,55 @@
+// Copyright (c) 2018 Daktronics. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include "placement.h"
+
+#include <stdint.h>
+#include <functional>
+#include <memory>
+#include <vector>
+
+struct JobState;
+
+//
+// a job handed to a job system ... can be waited on, or named as a
+// dependency of later jobs
+//
+typedef std::shared_ptr<JobState> Job;
+
+//
+// work-stealing pool for short cpu jobs (eg. per-frame text formatting
+// and geometry generation) ... each worker keeps its own deque, runs
+// the newest job it queued and steals the oldest from the others when
+// it runs dry
+//
+class IJobSystem
+{
+public:
+	IJobSystem() {}
+	virtual ~IJobSystem() {}
+
+	// run a callback once every job in after is done (a null job counts
+	// as done) ... jobs still queued when the system goes away are dropped
+	virtual Job run(std::function<void()> const&,
+		std::vector<Job> const& after = std::vector<Job>()) = 0;
+
+	// block until the job is done ... the caller runs queued jobs while it
+	// waits, so a job may wait on another without tying up a worker
+	virtual void wait(Job const&) = 0;
+
+	virtual bool done(Job const&) const = 0;
+
+	virtual uint32_t threads() const = 0;
+
+private:
+	IJobSystem(IJobSystem const&) = delete;
+	IJobSystem& operator=(IJobSystem const&) = delete;
+};
+
+// 0 threads = one per core, less one for the caller ... each worker
+// applies placement as it starts
+std::shared_ptr<IJobSystem> create_job_system(uint32_t threads = 0,
+	ThreadPlacement const& placement = ThreadPlacement());
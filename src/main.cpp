@@ -6,6 +6,11 @@
 #include "util.h"
 #include "scene.h"
 #include "assets.h"
+#include "headless.h"
+#include "clock.h"
+#include "jobs.h"
+#include "placement.h"
+#include "trace.h"
 
 #include "resource.h"
 
@@ -44,113 +49,283 @@ public:
 	~ComInitializer() { CoUninitialize(); }
 };
 
+Clock clock_;
+atomic_bool abort_;
+
+// where --trace writes (see on_command)
+string trace_file_;
+
+//
+// how the producer and consumer(s) are driven
+//
+enum class Pipeline
+{
+	// one thread updates + renders every scene in turn ... the consumer's
+	// vsync paces the producer
+	sync,
+
+	// each scene runs on its own thread and they only meet at the queue
+	// ... the producer paces itself against the consumer's vblanks
+	threaded
+};
+
 //
-// a pausable-clock
+// frame statistics for a single render thread ... logs a summary of 
+// each second (times are microseconds)
 //
-class Clock
+class LoopStats
 {
 private:
-	int64_t start_time_;
-	int64_t pause_time_;
+	string const name_;
+	uint64_t start_;
+	uint64_t frames_;
 
-public:
-	Clock()
-		: pause_time_(-1ll) {
-		start();
-	}
+	// frames the scheduler skipped because we fell behind
+	uint64_t missed_;
 
-	void start() 
-	{
-		auto const t = time_now();
-		if (pause_time_ >= 0ll) {
-			start_time_ = t - (pause_time_ - start_time_);
-		}
-		else {
-			start_time_ = t;
-		}
-		pause_time_ = -1ll;
-	}
+	// waiting on the pacer, in tick(), render() and present()
+	Histogram wait_;
+	Histogram tick_;
+	Histogram render_;
+	Histogram present_;
 
-	void stop() { 
-		start_time_ = pause_time_ = -1ll; 
-	}
+	// exact frame times (ms) ... log2 buckets are too coarse for
+	// percentiles of times that all sit near the frame period
+	vector<double> frame_;
 
-	void pause() {
-		if (start_time_ >= 0ll) {
-			pause_time_ = time_now();
-		}
-	}
+	// what the os scheduler did to this thread
+	ThreadMonitor monitor_;
 
-	bool is_paused() const {
-		return pause_time_ >= 0ll;
+public:
+	// on the thread it reports on
+	LoopStats(string const& name)
+		: name_(name)
+		, monitor_(name) {
+		reset(time_now());
 	}
 
-	int64_t now() const {
-		if (start_time_ >= 0ll) 
+	void add(uint64_t wait, uint64_t tick, uint64_t render, uint64_t present,
+		uint64_t missed)
+	{
+		missed_ += missed;
+		wait_.add(wait);
+		tick_.add(tick);
+		render_.add(render);
+		present_.add(present);
+		frame_.push_back((wait + tick + render + present) / 1000.0);
+		monitor_.frame();
+		++frames_;
+
+		auto const now = time_now();
+		if ((now - start_) >= 1000000)
 		{
-			if (pause_time_ >= 0ll) {
-				return pause_time_ - start_time_;
+			log_message("%s: %.1f fps (%llu missed), frame p50 %.2f p99 %.2f max %.2f ms, "
+				"wait %.2f, tick %.2f, render %.2f, present %.2f ms (mean)\n",
+				name_.c_str(),
+				frames_ * 1000000.0 / (now - start_),
+				static_cast<unsigned long long>(missed_),
+				percentile(frame_, 0.50),
+				percentile(frame_, 0.99),
+				percentile(frame_, 1.0),
+				wait_.mean() / 1000.0,
+				tick_.mean() / 1000.0,
+				render_.mean() / 1000.0,
+				present_.mean() / 1000.0);
+			auto const& sched = monitor_.report();
+			if (sched.available)
+			{
+				log_message("%s: %llu preempted, run delay p50 %.2f p99 %.2f max %.2f ms per frame\n",
+					name_.c_str(),
+					static_cast<unsigned long long>(sched.switches),
+					sched.delay_per_frame.percentile(0.50) / 1000.0,
+					sched.delay_per_frame.percentile(0.99) / 1000.0,
+					sched.delay_per_frame.max / 1000.0);
 			}
-			return time_now() - start_time_;
+			reset(now);
 		}
-		return 0ll;
 	}
-};
 
-Clock clock_;
-atomic_bool abort_;
+private:
+	void reset(uint64_t now)
+	{
+		start_ = now;
+		frames_ = 0;
+		missed_ = 0;
+		wait_ = Histogram();
+		tick_ = Histogram();
+		render_ = Histogram();
+		present_ = Histogram();
+		frame_.clear();
+		monitor_.reset();
+	}
+};
 
 //
 // synchronus render loop for update + render on both producer and consumer
+// ... at a fixed rate with hz, otherwise at the consumer's vsync
 //
 void render_loop_sync(
-	shared_ptr<IScene> const& producer, shared_ptr<IScene> const& consumer)
+	shared_ptr<IScene> const& producer, vector<shared_ptr<IScene>> const& consumers,
+	double hz, ThreadPlacement placement)
 {
+	set_thread_placement(placement);
+
+	FrameScheduler scheduler(hz);
+	auto const scheduled = (scheduler.rate() > 0.0);
+
+	// without a consumer here to vsync against (it's in another process)
+	// ... pace the producer to whoever consumes the queue
+	ProducerPacer pacer;
+	auto const pace = producer && consumers.empty() && !scheduled;
+
+	trace_thread_name("sync");
+	LoopStats stats("sync");
+
+	// ticks made while not paused ... with a fixed step, these (not the
+	// wall clock) set the scene time
+	int64_t ticks = 0;
+
 	while (!abort_)
 	{
-		auto const t = clock_.now() / 1000000.0;
+		auto const t0 = time_now();
+		auto const missed = scheduler.missed();
+		if (scheduled) {
+			scheduler.wait();
+		}
+		else if (pace) {
+			pacer.begin(producer->queue()->consumer_timing());
+		}
 
-		// update + render the producer
-		if (!clock_.is_paused()) {
-			producer->tick(t);
+		auto const paused = clock_.is_paused();
+		auto const t = clock_.tick_time(ticks);
+		if (!paused) {
+			++ticks;
 		}
-		producer->render();
 
-		// update + render the consumer
-		if (!clock_.is_paused()) {
-			consumer->tick(t);
+		// update + render the producer (unless it runs in another process)
+		auto const t1 = time_now();
+		uint64_t tick = 0;
+		if (producer)
+		{
+			if (!paused) {
+				producer->tick(t);
+			}
+			tick += time_now() - t1;
+			producer->render();
+		}
+
+		// update + render the consumer(s)
+		for (auto const& consumer : consumers)
+		{
+			auto const t2 = time_now();
+			if (!paused) {
+				consumer->tick(t);
+			}
+			tick += time_now() - t2;
+			consumer->render();
 		}
-		consumer->render();
 
 		// our preview window shows the producer ... without vsync
-		producer->present(0);
+		auto const t3 = time_now();
+		if (producer) {
+			producer->present(0);
+		}
+
+		// our output windows are vsync'd for the consumer(s) ... unless
+		// the scheduler sets the rate
+		for (auto const& consumer : consumers) {
+			consumer->present(scheduled ? 0 : 1);
+		}
+
+		if (pace) {
+			pacer.end();
+		}
 
-		// our main window is vsync'd for the consumer
-		consumer->present(1);
+		auto const t4 = time_now();
+		stats.add(t1 - t0, tick, (t3 - t1) - tick, t4 - t3, 
+			scheduler.missed() - missed);
 	}
 }
 
 //
-// render loop to drive a single scene ... can be used to run
-// the producer and consumer concurrently
+// render loop to drive a single scene ... used to run the producer
+// and consumer(s) concurrently
 //
-void render_loop(shared_ptr<IScene> const& scene, bool producer)
+void render_loop(
+	shared_ptr<IScene> const& scene, bool producer, string const& name, double hz,
+	ThreadPlacement placement)
 {
+	set_thread_placement(placement);
+
+	// the producer renders just in time for the consumer ... which runs
+	// at a fixed rate with hz, otherwise at its vsync
+	ProducerPacer pacer;
+	FrameScheduler scheduler(producer ? 0.0 : hz);
+	auto const scheduled = (scheduler.rate() > 0.0);
+
+	trace_thread_name(name);
+	LoopStats stats(name);
+	int64_t ticks = 0;
+
 	while (!abort_)
 	{
-		auto const t = clock_.now() / 1000000.0;
+		auto const t0 = time_now();
+		auto const missed = scheduler.missed();
+		if (producer) {
+			pacer.begin(scene->queue()->consumer_timing());
+		}
+		else if (scheduled) {
+			scheduler.wait();
+		}
 
 		// update + render the scene
+		auto const t1 = time_now();
 		if (!clock_.is_paused()) {
-			scene->tick(t);
+			scene->tick(clock_.tick_time(ticks++));
 		}
+		auto const t2 = time_now();
 		scene->render();
 
-		// for producer ... no vsync
-		scene->present(producer ? 0 : 1);
+		// for producer (or a scheduled consumer) ... no vsync
+		auto const t3 = time_now();
+		scene->present((producer || scheduled) ? 0 : 1);
+
+		if (producer) {
+			pacer.end();
+		}
+
+		auto const t4 = time_now();
+		stats.add(t1 - t0, t2 - t1, t3 - t2, t4 - t3, 
+			scheduler.missed() - missed);
 	}
 }
 
+//
+// hand headless results to a file ... or to the console that started us
+// (we're a gui app, so there isn't one by default)
+//
+int write_headless(string const& results, string const& out_file)
+{
+	if (!out_file.empty())
+	{
+		ofstream file(out_file);
+		file << results;
+		return file ? 0 : 1;
+	}
+
+	if (AttachConsole(ATTACH_PARENT_PROCESS))
+	{
+		auto const out = GetStdHandle(STD_OUTPUT_HANDLE);
+		DWORD written = 0;
+		WriteFile(out, results.c_str(), static_cast<DWORD>(results.size()), &written, nullptr);
+		FreeConsole();
+		return 0;
+	}
+
+	// too long for log_message()
+	OutputDebugStringA(results.c_str());
+	return 0;
+}
 
 int APIENTRY wWinMain(HINSTANCE instance, HINSTANCE, LPWSTR, int)
 {
@@ -159,6 +334,38 @@ int APIENTRY wWinMain(HINSTANCE instance, HINSTANCE, LPWSTR, int)
 
 	uint32_t width = 0;
 	uint32_t height = 0;
+	uint32_t outputs = 1;
+
+	// --share=<name> runs only the producer (or with --role=consumer, only
+	// the consumer) and hands surfaces to the other process
+	string share_name;
+	string role;
+
+	// --pipeline=threaded runs every scene on its own thread
+	auto pipeline = Pipeline::sync;
+
+	// --hz=<rate> runs the consumer(s) at a fixed rate (eg. 50, 59.94) 
+	// rather than the display's vsync
+	double hz = 0.0;
+
+	// --fixed-step=<rate> advances the scene time by exactly 1/rate per
+	// tick, whatever the wall clock does ... so runs are reproducible
+	int64_t fixed_step = 0;
+
+	// --producer-cpus, --consumer-cpus, --priority, --isolate etc. place
+	// the render and job threads (see parse_thread_option)
+	ThreadSettings thread_settings;
+
+	// --trace=<file> records trace zones from the start ... Ctrl+T writes
+	// them out as Chrome trace json (as does exiting)
+	string trace_file;
+
+	// --headless runs the pipeline on the cpu backend for --frames=N 
+	// without any windows, and writes json results to --out=<file> (or
+	// the console we were started from)
+	auto headless = false;
+	HeadlessOptions headless_options;
+	string out_file;
 
 	int args;
 	LPWSTR* arg_list = CommandLineToArgvW(GetCommandLineW(), &args);
@@ -191,27 +398,93 @@ int APIENTRY wWinMain(HINSTANCE instance, HINSTANCE, LPWSTR, int)
 						height = to_int(value.substr(c + 1), 0);
 					}
 				}
+				else if (key == "outputs") 
+				{
+					// # of consumer windows fed by the single producer
+					outputs = to_int(value, 1);
+					if (outputs < 1) {
+						outputs = 1;
+					}
+				}
+				else if (key == "share") {
+					share_name = value;
+				}
+				else if (key == "role") {
+					role = value;
+				}
+				else if (key == "pipeline") {
+					pipeline = (value == "threaded") ? Pipeline::threaded : Pipeline::sync;
+				}
+				else if (key == "hz") {
+					hz = strtod(value.c_str(), nullptr);
+				}
+				else if (key == "fixed-step") {
+					fixed_step = to_step(strtod(value.c_str(), nullptr));
+				}
+				else if (key == "headless") {
+					headless = true;
+				}
+				else if (key == "out") {
+					out_file = value;
+				}
+				else if (key == "trace") {
+					trace_file = value;
+				}
+
+				// the headless run shares most of our options
+				parse_thread_option(key, value, thread_settings);
+				parse_headless_option(key, value, headless_options);
 			}
 		}
 	}
 
+	if (headless) {
+		return write_headless(run_headless(headless_options), out_file);
+	}
+
+	if (!trace_file.empty())
+	{
+		trace_file_ = trace_file;
+		trace_enable(true);
+	}
+
 	// load keyboard accelerators
 	auto const accel_table =
 		LoadAccelerators(instance, MAKEINTRESOURCE(IDR_APPLICATION));
 
+	// which side(s) of the queue run in this process
+	auto const run_consumer = share_name.empty() || (role == "consumer");
+	auto const run_producer = share_name.empty() || (role != "consumer");
+
+	// a shared queue only feeds a single consumer
+	if (!share_name.empty()) {
+		outputs = 1;
+	}
+
 	// create window(s) with our specific size
-	auto const win_main = create_window(instance);
-	if (!IsWindow(win_main)) {
-		assert(0);
-		return 0;
+	vector<HWND> win_outputs;
+	for (uint32_t n = 0; run_consumer && n < outputs; ++n)
+	{
+		auto const window = create_window(instance);
+		if (!IsWindow(window)) {
+			assert(0);
+			return 0;
+		}
+		win_outputs.push_back(window);
 	}
 
-	auto const win_preview = create_window(instance);
-	if (!IsWindow(win_preview)) {
-		assert(0);
-		return 0;
+	HWND win_preview = nullptr;
+	if (run_producer)
+	{
+		win_preview = create_window(instance);
+		if (!IsWindow(win_preview)) {
+			assert(0);
+			return 0;
+		}
 	}
 
+	auto const win_main = run_consumer ? win_outputs.front() : win_preview;
+
 	// find a decent default size so on startup 
 	// we're not scaling at all
 	if (!width || !height) 
@@ -241,38 +514,102 @@ int APIENTRY wWinMain(HINSTANCE instance, HINSTANCE, LPWSTR, int)
 		}
 	}
 	
-	auto assets = create_assets();
+	shared_ptr<IAssets> assets;
+	shared_ptr<IScene> producer;
+	if (run_producer)
+	{
+		assets = create_assets();
+		assets->generate(width, height);
 
-	assets->generate(width, height);
-	
-	auto producer = create_producer(win_preview, width, height, assets);
-	auto consumer = create_consumer(win_main, width, height, producer);
+		// with more than one output ... every consumer sees every frame
+		SurfaceQueueOptions queue_options;
+		queue_options.fanout = (outputs > 1);
+		queue_options.share_name = share_name;
+
+		// the producer's tick() jobs
+		auto const jobs = create_job_system(2, thread_settings.resolve(thread_settings.workers));
 
-	SetWindowLongPtr(win_main, GWLP_USERDATA, (LONG_PTR)consumer.get());
-	SetWindowLongPtr(win_preview, GWLP_USERDATA, (LONG_PTR)producer.get());
+		producer = create_producer(
+			win_preview, width, height, assets, queue_options, jobs);
+		if (!producer) {
+			return 0;
+		}
+	}
 
-	zoom_to_screen(win_main);
-	zoom_to_screen(win_preview);
+	// a consumer-only process finds the font atlas for its stats overlay
+	// where the producer's process left it
+	if (!assets && !win_outputs.empty()) {
+		assets = create_assets();
+	}
+
+	vector<shared_ptr<IScene>> consumers;
+	for (auto const& window : win_outputs) 
+	{
+		auto const consumer = producer ?
+			create_consumer(window, width, height, producer, assets) :
+			create_consumer(window, width, height, create_shared_surface_queue(
+				share_name, SurfaceQueueRole::consumer), assets);
+		if (!consumer) {
+			return 0;
+		}
+		SetWindowLongPtr(window, GWLP_USERDATA, (LONG_PTR)consumer.get());
+		consumers.push_back(consumer);
+	}
+
+	if (win_preview) {
+		SetWindowLongPtr(win_preview, GWLP_USERDATA, (LONG_PTR)producer.get());
+	}
+
+	for (auto const& window : win_outputs) {
+		zoom_to_screen(window);
+	}
+	if (win_preview) {
+		zoom_to_screen(win_preview);
+	}
 	
 	// make the windows visible now that we have D3D components ready
-	ShowWindow(win_main, SW_NORMAL);
-	ShowWindow(win_preview, SW_NORMAL);
+	for (auto const& window : win_outputs) {
+		ShowWindow(window, SW_NORMAL);
+	}
+	if (win_preview) {
+		ShowWindow(win_preview, SW_NORMAL);
+	}
 	
+	// the ui thread (like any other we don't place) stays off the render
+	// threads' cpus with --isolate
+	set_thread_placement(thread_settings.other());
+
+	auto const producer_placement = thread_settings.resolve(thread_settings.producer);
+	auto const consumer_placement = thread_settings.resolve(thread_settings.consumer);
+
+	clock_.set_fixed_step(fixed_step);
 	clock_.start();
 
 	vector<shared_ptr<thread>> threads;
 	abort_ = false;
 
-	{ // add a single rendering thread
-
-		threads.push_back(make_shared<thread>(render_loop_sync, producer, consumer));
+	if (pipeline == Pipeline::threaded) 
+	{ 
+		// add rendering threads for each scene ... each one has its own
+		// device, so they only share the surface queue
+		if (producer) {
+			threads.push_back(make_shared<thread>(render_loop, 
+				producer, true, "producer", hz, producer_placement));
+		}
+		for (size_t n = 0; n < consumers.size(); ++n) 
+		{
+			threads.push_back(make_shared<thread>(render_loop, 
+				consumers[n], false, "consumer " + to_string(n), hz, consumer_placement));
+		}
+	}
+	else 
+	{ 
+		// add a single rendering thread
+		// it presents the outputs ... so it's placed as a consumer (or as the
+		// producer when the consumers are in another process)
+		threads.push_back(make_shared<thread>(render_loop_sync, producer, consumers, hz, 
+			consumers.empty() ? producer_placement : consumer_placement));
 	}
-
-	/*{ // add rendering threads for each scene
-		
-		threads.push_back(make_shared<thread>(render_loop, producer, true));
-		threads.push_back(make_shared<thread>(render_loop, consumer, false));
-	}*/
 
 	// main message pump for our application
 	MSG msg = {};
@@ -285,15 +622,26 @@ int APIENTRY wWinMain(HINSTANCE instance, HINSTANCE, LPWSTR, int)
 		}
 	}
 	
-	// stop all rendering threads
+	// stop all rendering threads ... closing the queue wakes anyone
+	// blocked in checkout() or consume() rather than waiting them out
 	abort_ = true;
+	if (producer) {
+		producer->queue()->close();
+	}
+	for (auto const& consumer : consumers) {
+		consumer->queue()->close();
+	}
 	for (auto const& t : threads) {
 		t->join();
 	}
 
+	if (trace_enabled()) {
+		trace_save(trace_file_);
+	}
+
 	// drop before COM is uninitialized
 	producer.reset();
-	consumer.reset();
+	consumers.clear();
 	assets.reset();	
 	
 	return 0;
@@ -396,6 +744,15 @@ void on_command(HWND window, uint32_t id)
 		case ID_WINDOW_VSYNC:
 			break;
 
+		case ID_TRACE_SAVE:
+			if (trace_enabled()) {
+				trace_save(trace_file_);
+			}
+			else {
+				log_message("tracing is off ... start with --trace=<file>\n");
+			}
+			break;
+
 		case ID_CLOCK_PAUSE:
 			if (clock_.is_paused()) {
 				clock_.start();
@@ -0,0 +1,301 @@
+// Copyright (c) 2018 Daktronics. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+#if defined(_WIN32)
+#include "platform.h"
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+
+#include "placement.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <thread>
+
+using namespace std;
+
+namespace {
+
+	// every cpu we could place a thread on
+	uint64_t all_cpus()
+	{
+		auto const cores = thread::hardware_concurrency();
+		if (!cores || cores >= 64) {
+			return ~0ull;
+		}
+		return (1ull << cores) - 1;
+	}
+
+	//
+	// a list of cpus and ranges (eg. 0,2,4-7) as a mask ... cpus past
+	// 63 are ignored
+	//
+	uint64_t parse_cpus(string const& value)
+	{
+		uint64_t mask = 0;
+		size_t pos = 0;
+		while (pos < value.size())
+		{
+			auto end = value.find(',', pos);
+			if (end == string::npos) {
+				end = value.size();
+			}
+
+			auto const item = value.substr(pos, end - pos);
+			auto const dash = item.find('-');
+			auto const first = to_int(item.substr(0, dash), -1);
+			auto const last = (dash != string::npos) ? to_int(item.substr(dash + 1), -1) : first;
+			for (auto cpu = first; cpu >= 0 && cpu <= last && cpu < 64; ++cpu) {
+				mask |= (1ull << cpu);
+			}
+			pos = end + 1;
+		}
+		return mask;
+	}
+
+	ThreadPriority parse_priority(string const& value)
+	{
+		if (value == "realtime") {
+			return ThreadPriority::realtime;
+		}
+		if (value == "high") {
+			return ThreadPriority::high;
+		}
+		return ThreadPriority::normal;
+	}
+}
+
+ThreadPlacement ThreadSettings::other() const
+{
+	ThreadPlacement placement;
+	if (isolate)
+	{
+		// if that leaves nothing, any cpu (0) rather than none
+		auto const reserved = producer.cpus | consumer.cpus;
+		placement.cpus = all_cpus() & ~reserved;
+	}
+	return placement;
+}
+
+ThreadPlacement ThreadSettings::resolve(ThreadPlacement const& placement) const
+{
+	auto resolved = placement;
+	if (!resolved.cpus) {
+		resolved.cpus = other().cpus;
+	}
+	return resolved;
+}
+
+bool parse_thread_option(string const& key, string const& value, ThreadSettings& settings)
+{
+	if (key == "producer-cpus") {
+		settings.producer.cpus = parse_cpus(value);
+	}
+	else if (key == "consumer-cpus") {
+		settings.consumer.cpus = parse_cpus(value);
+	}
+	else if (key == "worker-cpus") {
+		settings.workers.cpus = parse_cpus(value);
+	}
+	else if (key == "priority") {
+		settings.producer.priority = settings.consumer.priority = parse_priority(value);
+	}
+	else if (key == "worker-priority") {
+		settings.workers.priority = parse_priority(value);
+	}
+	else if (key == "isolate") {
+		settings.isolate = true;
+	}
+	else {
+		return false;
+	}
+	return true;
+}
+
+#if defined(_WIN32)
+
+bool set_thread_placement(ThreadPlacement const& placement)
+{
+	auto ok = true;
+	auto const thread = GetCurrentThread();
+
+	// only the first 64 cpus (the thread's processor group)
+	if (placement.cpus)
+	{
+		if (!SetThreadAffinityMask(thread, static_cast<DWORD_PTR>(placement.cpus)))
+		{
+			log_message("failed to set thread affinity (0x%llx): %u\n",
+				static_cast<unsigned long long>(placement.cpus), GetLastError());
+			ok = false;
+		}
+	}
+
+	if (placement.priority != ThreadPriority::normal)
+	{
+		auto const priority = (placement.priority == ThreadPriority::realtime) ?
+			THREAD_PRIORITY_TIME_CRITICAL : THREAD_PRIORITY_HIGHEST;
+		if (!SetThreadPriority(thread, priority))
+		{
+			log_message("failed to set thread priority: %u\n", GetLastError());
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+//
+// windows doesn't keep per-thread preemption or ready-time counts
+// where we can get at them ... the monitor only counts frames
+//
+ThreadMonitor::ThreadMonitor(string const& name)
+	: schedstat_(-1)
+{
+	report_.name = name;
+	reset();
+}
+
+ThreadMonitor::~ThreadMonitor() {
+}
+
+bool ThreadMonitor::sample(uint64_t& switches, uint64_t& delay)
+{
+	switches = delay = 0;
+	return false;
+}
+
+#else
+
+bool set_thread_placement(ThreadPlacement const& placement)
+{
+	auto ok = true;
+	auto const thread = pthread_self();
+
+	if (placement.cpus)
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (int cpu = 0; cpu < 64; ++cpu)
+		{
+			if (placement.cpus & (1ull << cpu)) {
+				CPU_SET(cpu, &set);
+			}
+		}
+
+		auto const err = pthread_setaffinity_np(thread, sizeof(set), &set);
+		if (err)
+		{
+			log_message("failed to set thread affinity (0x%llx): %d\n",
+				static_cast<unsigned long long>(placement.cpus), err);
+			ok = false;
+		}
+	}
+
+	if (placement.priority == ThreadPriority::realtime)
+	{
+		// mid-range, so there's still room above us for the kernel's own
+		sched_param param = {};
+		param.sched_priority = (sched_get_priority_min(SCHED_FIFO) +
+			sched_get_priority_max(SCHED_FIFO)) / 2;
+		auto const err = pthread_setschedparam(thread, SCHED_FIFO, &param);
+		if (err)
+		{
+			log_message("failed to set SCHED_FIFO: %d\n", err);
+			ok = false;
+		}
+	}
+	else if (placement.priority == ThreadPriority::high)
+	{
+		// nice applies per thread (by tid) on linux
+		auto const tid = static_cast<id_t>(syscall(SYS_gettid));
+		if (setpriority(PRIO_PROCESS, tid, -10))
+		{
+			log_message("failed to set thread nice value\n");
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+ThreadMonitor::ThreadMonitor(string const& name)
+	: schedstat_(-1)
+{
+	report_.name = name;
+
+	// run delay is the 2nd field of the thread's schedstat (ns)
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/self/task/%ld/schedstat",
+		static_cast<long>(syscall(SYS_gettid)));
+	schedstat_ = open(path, O_RDONLY);
+	reset();
+}
+
+ThreadMonitor::~ThreadMonitor()
+{
+	if (schedstat_ >= 0) {
+		close(schedstat_);
+	}
+}
+
+bool ThreadMonitor::sample(uint64_t& switches, uint64_t& delay)
+{
+	switches = delay = 0;
+
+	rusage usage = {};
+	if (getrusage(RUSAGE_THREAD, &usage)) {
+		return false;
+	}
+	switches = static_cast<uint64_t>(usage.ru_nivcsw);
+
+	if (schedstat_ < 0) {
+		return false;
+	}
+
+	char buffer[128];
+	auto const n = pread(schedstat_, buffer, sizeof(buffer) - 1, 0);
+	if (n <= 0) {
+		return false;
+	}
+	buffer[n] = 0;
+
+	char* end = nullptr;
+	strtoull(buffer, &end, 10);
+	delay = strtoull(end, nullptr, 10);
+	return true;
+}
+
+#endif
+
+void ThreadMonitor::frame()
+{
+	++report_.frames;
+
+	uint64_t switches, delay;
+	if (!sample(switches, delay)) {
+		return;
+	}
+
+	auto const new_switches = switches - last_switches_;
+	report_.switches += new_switches;
+	report_.switches_per_frame.add(new_switches);
+	report_.delay_per_frame.add((delay - last_delay_) / 1000);
+
+	last_switches_ = switches;
+	last_delay_ = delay;
+}
+
+void ThreadMonitor::reset()
+{
+	ThreadReport report;
+	report.name = report_.name;
+	report.available = sample(last_switches_, last_delay_);
+	report_ = report;
+}
@@ -0,0 +1,125 @@
+// Copyright (c) 2018 Daktronics. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include "scene.h"
+
+#include <string>
+
+enum class ThreadPriority
+{
+	// leave the thread as the os made it
+	normal,
+
+	// above other work ... THREAD_PRIORITY_HIGHEST / a negative nice value
+	high,
+
+	// THREAD_PRIORITY_TIME_CRITICAL / SCHED_FIFO ... a busy loop at this
+	// level can starve the rest of the system
+	realtime
+};
+
+//
+// where (and how urgently) a thread runs
+//
+struct ThreadPlacement
+{
+	// bit n = cpu n (0 = any cpu)
+	uint64_t cpus = 0;
+
+	ThreadPriority priority = ThreadPriority::normal;
+};
+
+//
+// placements for each kind of thread we start
+//
+struct ThreadSettings
+{
+	ThreadPlacement producer;
+	ThreadPlacement consumer;
+
+	// job system workers
+	ThreadPlacement workers;
+
+	// keep every thread without cpus of its own (eg. workers, the ui)
+	// off the cpus given to the producer and consumer
+	bool isolate = false;
+
+	// the placement for threads that weren't given one ... with isolate,
+	// any cpu the producer and consumer don't have
+	ThreadPlacement other() const;
+
+	// a placement as it should be applied (see isolate)
+	ThreadPlacement resolve(ThreadPlacement const&) const;
+};
+
+// applies to the calling thread ... false (and logged) if the os refused
+// any part of it (eg. realtime priority without the privilege)
+bool set_thread_placement(ThreadPlacement const&);
+
+// applies a --key=value command line option ... false if it isn't ours
+//
+//   --producer-cpus=2,3  --consumer-cpus=4-5  --worker-cpus=6-7
+//   --priority=normal|high|realtime (producer and consumer)
+//   --worker-priority=normal|high|realtime
+//   --isolate
+//
+bool parse_thread_option(
+	std::string const& key, std::string const& value, ThreadSettings&);
+
+//
+// what the os scheduler did to a thread ... involuntary switches are
+// preemptions (as opposed to blocking), and run delay is time spent
+// runnable but waiting for a cpu
+//
+struct ThreadReport
+{
+	std::string name;
+
+	// false where the os doesn't keep per-thread counts we can read
+	// (only linux does) ... the counts are all zero then
+	bool available = false;
+
+	uint64_t frames = 0;
+
+	// involuntary switches in total ... and per frame
+	uint64_t switches = 0;
+	Histogram switches_per_frame;
+
+	// run delay (us) per frame
+	Histogram delay_per_frame;
+};
+
+//
+// builds a ThreadReport a frame at a time ... create it on the thread it
+// watches and call frame() once per frame there
+//
+class ThreadMonitor
+{
+private:
+	ThreadReport report_;
+	int schedstat_;
+
+	uint64_t last_switches_;
+	uint64_t last_delay_;
+
+public:
+	ThreadMonitor(std::string const& name);
+	~ThreadMonitor();
+
+	// folds in the counts since the previous call
+	void frame();
+
+	ThreadReport const& report() const { return report_; }
+
+	// start over (eg. every reporting interval)
+	void reset();
+
+private:
+	bool sample(uint64_t& switches, uint64_t& delay);
+
+	ThreadMonitor(ThreadMonitor const&) = delete;
+	ThreadMonitor& operator=(ThreadMonitor const&) = delete;
+};
@@ -4,8 +4,14 @@
 
 #include "scene.h"
 #include "util.h"
+#include "trace.h"
+
+#include <assert.h>
 
 #include <list>
+#include <vector>
+#include <algorithm>
+#include <thread>
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
@@ -15,100 +21,1808 @@ using namespace std;
 
 namespace {
 
-	class BlockingQueue
+	//
+	// note when (and how urgently) a surface was handed over to the queue
+	//
+	void stamp(shared_ptr<ISurface> const& surface, SurfacePriority priority)
+	{
+		auto info = surface->frame_info();
+		info.produced = time_now();
+		info.priority = priority;
+		surface->set_frame_info(info);
+	}
+
+	bool urgent(shared_ptr<ISurface> const& surface) {
+		return surface->frame_info().priority == SurfacePriority::high;
+	}
+
+	size_t lane_of(shared_ptr<ISurface> const& surface) {
+		return static_cast<size_t>(surface->frame_info().priority);
+	}
+
+	bool expired(shared_ptr<ISurface> const& surface, uint64_t now)
+	{
+		auto const deadline = surface->frame_info().deadline;
+		return deadline && (deadline < now);
+	}
+
+	//
+	// lock-free log2 histogram ... each instance is only recorded into from
+	// a single thread, so plain load/store is enough (no locked instructions)
+	// and it can be read from anywhere
+	//
+	class AtomicHistogram
 	{
 	private:
-		list<shared_ptr<ISurface>> queue_;
-		condition_variable signal_;
-		mutex mutable lock_;
+		atomic<uint64_t> counts_[Histogram::buckets];
+		atomic<uint64_t> count_;
+		atomic<uint64_t> total_;
+		atomic<uint64_t> max_;
 
 	public:
+		AtomicHistogram()
+			: count_(0)
+			, total_(0)
+			, max_(0)
+		{
+			for (auto& c : counts_) {
+				c.store(0, memory_order_relaxed);
+			}
+		}
 
-		void push(std::shared_ptr<ISurface> const& surface)
+		void add(uint64_t value)
 		{
-			if (surface)
+			bump(counts_[Histogram::bucket_of(value)], 1);
+			bump(count_, 1);
+			bump(total_, value);
+			if (value > max_.load(memory_order_relaxed)) {
+				max_.store(value, memory_order_relaxed);
+			}
+		}
+
+		Histogram snapshot() const
+		{
+			Histogram h;
+			for (size_t n = 0; n < Histogram::buckets; ++n) {
+				h.counts[n] = counts_[n].load(memory_order_relaxed);
+			}
+			h.count = count_.load(memory_order_relaxed);
+			h.total = total_.load(memory_order_relaxed);
+			h.max = max_.load(memory_order_relaxed);
+			return h;
+		}
+
+	private:
+
+		static void bump(atomic<uint64_t>& value, uint64_t n) {
+			value.store(value.load(memory_order_relaxed) + n, memory_order_relaxed);
+		}
+	};
+
+	//
+	// running totals shared by the queue implementations
+	//
+	struct Counters
+	{
+		atomic<uint64_t> produced;
+		atomic<uint64_t> consumed;
+		atomic<uint64_t> dropped;
+		atomic<uint64_t> late;
+		atomic<uint64_t> on_time;
+		atomic<uint64_t> checkout_timeouts;
+		atomic<uint64_t> consume_timeouts;
+
+		AtomicHistogram checkout_wait;
+		AtomicHistogram consume_wait;
+		AtomicHistogram pool_depth;
+		AtomicHistogram due_depth;
+
+		// per priority
+		atomic<uint64_t> lane_produced[surface_priorities];
+		atomic<uint64_t> lane_consumed[surface_priorities];
+		AtomicHistogram lane_queued[surface_priorities];
+
+		Counters() 
+			: produced(0)
+			, consumed(0)
+			, dropped(0)
+			, late(0)
+			, on_time(0)
+			, checkout_timeouts(0)
+			, consume_timeouts(0)
+		{
+			for (size_t n = 0; n < surface_priorities; ++n) {
+				lane_produced[n].store(0, memory_order_relaxed);
+				lane_consumed[n].store(0, memory_order_relaxed);
+			}
+		}
+
+		static void increment(atomic<uint64_t>& counter) {
+			counter.fetch_add(1, memory_order_relaxed);
+		}
+
+		void on_produce(shared_ptr<ISurface> const& surface)
+		{
+			increment(produced);
+			increment(lane_produced[lane_of(surface)]);
+		}
+
+		// a consumer was handed the surface at time now
+		void on_consume(shared_ptr<ISurface> const& surface, uint64_t now)
+		{
+			auto const& info = surface->frame_info();
+			if (info.deadline) {
+				increment((info.deadline < now) ? late : on_time);
+			}
+
+			auto const lane = lane_of(surface);
+			increment(consumed);
+			increment(lane_consumed[lane]);
+			lane_queued[lane].add((now > info.produced) ? (now - info.produced) : 0);
+		}
+
+		SurfaceQueueStats snapshot() const
+		{
+			SurfaceQueueStats stats;
+			stats.produced = produced.load(memory_order_relaxed);
+			stats.consumed = consumed.load(memory_order_relaxed);
+			stats.dropped = dropped.load(memory_order_relaxed);
+			stats.late = late.load(memory_order_relaxed);
+			stats.on_time = on_time.load(memory_order_relaxed);
+			stats.checkout_timeouts = checkout_timeouts.load(memory_order_relaxed);
+			stats.consume_timeouts = consume_timeouts.load(memory_order_relaxed);
+			stats.checkout_wait = checkout_wait.snapshot();
+			stats.consume_wait = consume_wait.snapshot();
+			stats.pool_depth = pool_depth.snapshot();
+			stats.due_depth = due_depth.snapshot();
+			for (size_t n = 0; n < surface_priorities; ++n)
 			{
-				lock_guard<mutex> guard(lock_);
-				queue_.push_back(surface);
-				signal_.notify_all();
+				stats.lanes[n].produced = lane_produced[n].load(memory_order_relaxed);
+				stats.lanes[n].consumed = lane_consumed[n].load(memory_order_relaxed);
+				stats.lanes[n].queued = lane_queued[n].snapshot();
 			}
+			return stats;
 		}
+	};
 
-		shared_ptr<ISurface> pop(uint32_t timeout_ms)
+	//
+	// fold a consumer's side of the stats (everything from consume() on)
+	// into to
+	//
+	void add_consumer_side(SurfaceQueueStats& to, SurfaceQueueStats const& from)
+	{
+		to.consumed += from.consumed;
+		to.dropped += from.dropped;
+		to.late += from.late;
+		to.on_time += from.on_time;
+		to.consume_timeouts += from.consume_timeouts;
+		to.consume_wait.add(from.consume_wait);
+		to.due_depth.add(from.due_depth);
+		for (size_t n = 0; n < surface_priorities; ++n)
 		{
-			for (;;)
+			to.lanes[n].consumed += from.lanes[n].consumed;
+			to.lanes[n].queued.add(from.lanes[n].queued);
+		}
+	}
+
+	//
+	// lets high priority surfaces jump ahead of normal ones for a consumer
+	//
+	// the producer only counts the high priority surfaces it produces ...
+	// while any of those are unaccounted for, the consumer pulls everything
+	// pending off the due lane into held_ so it can look past the oldest
+	// (otherwise consume() takes the plain path through select_surface)
+	//
+	// high priority surfaces are never skipped, and at most burst of them 
+	// are handed out in a row while a normal surface is waiting
+	//
+	class Prioritizer
+	{
+	private:
+		atomic<uint64_t> produced_;
+
+		// consumer only
+		uint64_t pulled_;
+		list<shared_ptr<ISurface>> held_;
+		uint32_t const burst_;
+		uint32_t run_;
+
+	public:
+		Prioritizer(uint32_t burst)
+			: produced_(0)
+			, pulled_(0)
+			, burst_(max(burst, 1u))
+			, run_(0) {
+		}
+
+		// producer ... before the surface goes on the due lane
+		void on_produce(SurfacePriority priority)
+		{
+			if (priority == SurfacePriority::high) {
+				produced_.fetch_add(1, memory_order_relaxed);
+			}
+		}
+
+		bool holding() const {
+			return !held_.empty();
+		}
+
+		// nothing to sort out ... surf can go through select_surface
+		bool idle(shared_ptr<ISurface> const& surf) const {
+			return !urgent(surf) && produced_.load(memory_order_relaxed) == pulled_;
+		}
+
+		// a surface came off the due lane some other way
+		void pulled(shared_ptr<ISurface> const& surf)
+		{
+			if (surf && urgent(surf)) {
+				++pulled_;
+			}
+		}
+
+		//
+		// pick from everything pending (surf has already been popped and 
+		// may be null if we're holding surfaces)
+		//
+		template<class Lane, class Recycle>
+		shared_ptr<ISurface> select(
+			Lane& due,
+			shared_ptr<ISurface> surf,
+			SurfaceDelivery delivery,
+			Counters& counters,
+			Recycle recycle)
+		{
+			if (surf) {
+				hold(move(surf));
+			}
+			while (due.try_pop(surf)) {
+				hold(move(surf));
+			}
+
+			if (held_.empty()) {
+				return nullptr;
+			}
+
+			auto first_urgent = held_.end();
+			auto first_normal = held_.end();
+			for (auto i = held_.begin(); i != held_.end(); ++i)
 			{
-				{
-					lock_guard<mutex> guard(lock_);
-					if (!queue_.empty())
-					{
-						auto const s = queue_.front();
-						queue_.pop_front();
-						return s;
+				if (urgent(*i)) {
+					if (first_urgent == held_.end()) {
+						first_urgent = i;
 					}
 				}
+				else if (first_normal == held_.end()) {
+					first_normal = i;
+				}
+			}
 
-				unique_lock<mutex> lock(lock_);
-				if (!signal_.wait_for(lock, timeout_ms * 1ms,
-					[&]() { return (queue_.size() > 0); })) 
-				{
+			auto const now = time_now();
+
+			if (first_urgent != held_.end() && 
+				(run_ < burst_ || first_normal == held_.end()))
+			{
+				++run_;
+				return take(first_urgent, counters, now);
+			}
+
+			// same rules as select_surface ... but only over normal surfaces
+			run_ = 0;
+			auto pick = first_normal;
+			for (auto i = next(pick); i != held_.end(); ) 
+			{
+				if (urgent(*i)) {
+					++i;
+					continue;
+				}
+
+				if (delivery != SurfaceDelivery::mailbox && !expired(*pick, now)) {
 					break;
 				}
+
+				recycle(*pick);
+				Counters::increment(counters.dropped);
+				held_.erase(pick);
+				pick = i++;
 			}
-			return nullptr;
+			return take(pick, counters, now);
+		}
+
+		// everything held, oldest first
+		void drain(vector<shared_ptr<ISurface>>& surfaces)
+		{
+			surfaces.insert(surfaces.end(), held_.begin(), held_.end());
+			held_.clear();
+		}
+
+		// keep a surface already popped off the due lane (newest last)
+		void hold(shared_ptr<ISurface>&& surf)
+		{
+			pulled(surf);
+			held_.push_back(move(surf));
+		}
+
+	private:
+
+		shared_ptr<ISurface> take(
+			list<shared_ptr<ISurface>>::iterator i, Counters& counters, uint64_t now)
+		{
+			auto const surf = *i;
+			held_.erase(i);
+			counters.on_consume(surf, now);
+			return surf;
 		}
 	};
 
 	//
-	// surface queue implementation for exchange - not specific
-	// to either Direct3D 9 or 11
+	// pick which pending surface a consumer gets, starting from the oldest
+	// (surf) ... anything skipped over is handed to recycle()
 	//
-	class SurfaceQueue : public ISurfaceQueue, 
-						public enable_shared_from_this<SurfaceQueue>
+	// mailbox delivery always skips to the newest surface - otherwise we 
+	// only skip surfaces that missed their deadline while something newer
+	// is waiting behind them (so the consumer is never left empty handed)
+	//
+	// a high priority surface is never skipped ... if one turns up behind
+	// surf (produced after priority last looked idle) then both go to 
+	// priority to sort out
+	//
+	template<class Lane, class Recycle>
+	shared_ptr<ISurface> select_surface(
+		Lane& due, 
+		shared_ptr<ISurface> surf, 
+		SurfaceDelivery delivery,
+		Counters& counters,
+		Prioritizer& priority,
+		Recycle recycle)
+	{
+		auto const now = time_now();
+
+		shared_ptr<ISurface> newer;
+		while ((delivery == SurfaceDelivery::mailbox || expired(surf, now)) 
+			&& due.try_pop(newer))
+		{
+			if (urgent(newer))
+			{
+				priority.hold(move(surf));
+				return priority.select(due, move(newer), delivery, counters, recycle);
+			}
+
+			recycle(surf);
+			Counters::increment(counters.dropped);
+			surf = move(newer);
+		}
+
+		counters.on_consume(surf, now);
+		return surf;
+	}
+
+	//
+	// adjusts the # of surfaces in circulation for a queue with an allocator
+	//
+	// every so many checkouts we look at how the last window went: if the
+	// producer was starved while the consumer was also idle then surfaces are
+	// stuck in flight and another one helps ... if the pool never ran dry 
+	// then at least one surface is dead weight and can be released
+	//
+	// new surfaces go straight to the producer from checkout() rather than
+	// through the pool, as the consumer is the only writer to a ring lane
+	//
+	template<class Lane>
+	class PoolSizer
 	{
 	private:
-		BlockingQueue due_;
-		BlockingQueue pool_;
+		Lane& pool_;
+		shared_ptr<ISurfaceAllocator> const allocator_;
+		uint32_t const min_surfaces_;
+		uint32_t const max_surfaces_;
+		uint32_t surfaces_;
+
+		// current window ... producer thread only
+		uint32_t checkouts_;
+		uint32_t starved_;
+		size_t min_spare_;
+		bool grow_;
+
+		// current window ... consumer thread(s)
+		atomic<uint32_t> consumes_;
+		atomic<uint32_t> idle_;
+
+		static const uint32_t window = 60;
 
 	public:
-		SurfaceQueue() {
+		PoolSizer(Lane& pool,
+			shared_ptr<ISurfaceAllocator> const& allocator,
+			uint32_t min_surfaces,
+			uint32_t max_surfaces)
+			: pool_(pool)
+			, allocator_(allocator)
+			, min_surfaces_(max(min_surfaces, 1u))
+			, max_surfaces_(max(min_surfaces, max_surfaces))
+			, surfaces_(0)
+			, grow_(false)
+			, consumes_(0)
+			, idle_(0)
+		{
+			reset();
+
+			// the queue is still being created ... safe to fill the pool
+			while (allocator_ && surfaces_ < min_surfaces_) 
+			{
+				auto const surface = allocate();
+				if (!surface) {
+					break;
+				}
+				pool_.push(surface);
+			}
 		}
-		
-		void produce(std::shared_ptr<ISurface> const& surface) override {
-			due_.push(surface);
+
+		void on_consume(bool idle)
+		{
+			if (allocator_)
+			{
+				consumes_.fetch_add(1, memory_order_relaxed);
+				if (idle) {
+					idle_.fetch_add(1, memory_order_relaxed);
+				}
+			}
 		}
 
-		shared_ptr<ISurface> consume(uint32_t timeout_ms) override 
+		// the producer is checking out ... starved if the pool was empty
+		// (returns a new surface for the producer if the pool should grow)
+		shared_ptr<ISurface> on_checkout(bool starved)
+		{
+			if (!allocator_) {
+				return nullptr;
+			}
+
+			++checkouts_;
+			if (starved) {
+				++starved_;
+				min_spare_ = 0;
+			}
+			else {
+				min_spare_ = min(min_spare_, pool_.size());
+			}
+
+			if (checkouts_ >= window) 
+			{
+				resize();
+				reset();
+			}
+
+			if (starved && grow_)
+			{
+				grow_ = false;
+				auto const surface = allocate();
+				if (surface) {
+					log_message("surface pool grew to %u\n", surfaces_);
+				}
+				return surface;
+			}
+			return nullptr;
+		}
+
+	private:
+
+		void resize()
 		{
-			auto const surf = due_.pop(timeout_ms);
-			if (!surf) {
-				log_message("timeout waiting for consume\n");
+			auto const consumes = consumes_.load(memory_order_relaxed);
+			auto const idle = idle_.load(memory_order_relaxed);
+
+			if ((starved_ * 4) > checkouts_ && (idle * 4) > consumes)
+			{
+				grow_ = (surfaces_ < max_surfaces_);
+			}
+			else if (min_spare_ > 0 && surfaces_ > min_surfaces_)
+			{
+				shared_ptr<ISurface> surface;
+				if (pool_.try_pop(surface))
+				{
+					allocator_->release(surface);
+					--surfaces_;
+					log_message("surface pool shrank to %u\n", surfaces_);
+				}
+			}
+		}
+
+		shared_ptr<ISurface> allocate()
+		{
+			auto const surface = allocator_->allocate();
+			if (surface) {
+				++surfaces_;
 			}
+			return surface;
+		}
+
+		void reset()
+		{
+			checkouts_ = starved_ = 0;
+			min_spare_ = static_cast<size_t>(-1);
+			consumes_.store(0, memory_order_relaxed);
+			idle_.store(0, memory_order_relaxed);
+		}
+	};
+
+	//
+	// fetch a surface from the pool for the producer ... recording how 
+	// full the pool was and how long we had to wait
+	// (block = false for a try_checkout)
+	//
+	template<class Lane>
+	shared_ptr<ISurface> pop_pool(
+		Lane& pool, 
+		PoolSizer<Lane>& sizer, 
+		Counters& counters, 
+		bool block,
+		uint32_t timeout_ms)
+	{
+		if (pool.closed()) {
+			return nullptr;
+		}
+
+		counters.pool_depth.add(pool.size());
+
+		shared_ptr<ISurface> surf;
+		if (pool.try_pop(surf)) {
+			sizer.on_checkout(false);
+			counters.checkout_wait.add(0);
 			return surf;
 		}
 
-		// return a surface to the pool for re-use
-		// (consumers should call this when done with a surface they popped)
-		//
-		void checkin(std::shared_ptr<ISurface> const& surface) override {
-			pool_.push(surface);
+		// might be worth another surface
+		surf = sizer.on_checkout(true);
+		if (surf) {
+			counters.checkout_wait.add(0);
+			return surf;
 		}
 
-		// get a free surface to the pool for writing
-		// (producers should call this when they want to render to a new surface)
-		//
-		shared_ptr<ISurface> checkout(uint32_t timeout_ms) override
+		if (!block) {
+			return nullptr;
+		}
+
+		auto const start = time_now();
+		surf = pool.pop(timeout_ms);
+		counters.checkout_wait.add(time_now() - start);
+
+		if (!surf && !pool.closed()) {
+			Counters::increment(counters.checkout_timeouts);
+			log_message("timeout waiting for checkout\n");
+		}
+		return surf;
+	}
+
+	//
+	// take everything pending for a consumer in one go (after anything
+	// the prioritizer was holding)
+	//
+	template<class Lane, class Sizer>
+	vector<shared_ptr<ISurface>> drain_due(
+		Lane& due, Sizer& sizer, Counters& counters, Prioritizer& priority)
+	{
+		vector<shared_ptr<ISurface>> surfaces;
+		if (due.closed()) {
+			return surfaces;
+		}
+		priority.drain(surfaces);
+		auto const held = surfaces.size();
+		due.pop_all(surfaces);
+
+		counters.due_depth.add(surfaces.size());
+		sizer.on_consume(surfaces.empty());
+
+		auto const now = time_now();
+		for (size_t n = 0; n < surfaces.size(); ++n)
 		{
-			auto const surf = pool_.pop(timeout_ms);
-			if (!surf) {
-				log_message("timeout waiting for checkout\n");
+			if (n >= held) {
+				priority.pulled(surfaces[n]);
 			}
+			counters.on_consume(surfaces[n], now);
+		}
+		return surfaces;
+	}
+
+	//
+	// fetch the oldest pending surface for a consumer ... recording how 
+	// many were pending and how long we had to wait
+	// (block = false for a try_consume)
+	//
+	template<class Lane, class Sizer>
+	shared_ptr<ISurface> pop_due(
+		Lane& due, 
+		Sizer& sizer, 
+		Counters& counters, 
+		bool block,
+		uint32_t timeout_ms)
+	{
+		if (due.closed()) {
+			return nullptr;
+		}
+
+		auto const depth = due.size();
+		counters.due_depth.add(depth);
+		sizer.on_consume(depth == 0);
+
+		shared_ptr<ISurface> surf;
+		if (due.try_pop(surf)) {
+			counters.consume_wait.add(0);
 			return surf;
 		}
+
+		if (!block) {
+			return nullptr;
+		}
+
+		auto const start = time_now();
+		surf = due.pop(timeout_ms);
+		counters.consume_wait.add(time_now() - start);
+
+		if (!surf && !due.closed()) {
+			Counters::increment(counters.consume_timeouts);
+			log_message("timeout waiting for consume\n");
+		}
+		return surf;
+	}
+
+	//
+	// the consumer's vblank timing ... written by the consumer,
+	// read by the producer (a torn read only costs one frame of pacing)
+	//
+	class TimingCell
+	{
+	private:
+		atomic<uint64_t> period_;
+		atomic<uint64_t> last_;
+
+	public:
+		TimingCell()
+			: period_(0)
+			, last_(0) {
+		}
+
+		void mark(uint64_t vblank)
+		{
+			auto const timing = load().update(vblank);
+			period_.store(timing.period, memory_order_relaxed);
+			last_.store(timing.last, memory_order_relaxed);
+		}
+
+		ConsumerTiming load() const
+		{
+			ConsumerTiming timing;
+			timing.period = period_.load(memory_order_relaxed);
+			timing.last = last_.load(memory_order_relaxed);
+			return timing;
+		}
 	};
+
+	//
+	// optional callback for when surfaces become available ... 
+	// free to fire when nobody has asked for it
+	//
+	class Signal
+	{
+	private:
+		function<void()> callback_;
+		atomic_bool set_;
+		mutex lock_;
+
+	public:
+		Signal() 
+			: set_(false) {
+		}
+
+		void set(function<void()> const& callback)
+		{
+			lock_guard<mutex> guard(lock_);
+			callback_ = callback;
+			set_.store(callback_ != nullptr, memory_order_release);
+		}
+
+		void operator()()
+		{
+			if (set_.load(memory_order_acquire))
+			{
+				lock_guard<mutex> guard(lock_);
+				if (callback_) {
+					callback_();
+				}
+			}
+		}
+	};
+
+	class BlockingQueue
+	{
+	private:
+		list<shared_ptr<ISurface>> queue_;
+		atomic<size_t> size_;
+		atomic_bool closed_;
+		condition_variable signal_;
+		mutex mutable lock_;
+
+	public:
+		BlockingQueue() 
+			: size_(0)
+			, closed_(false) {
+		}
+
+		// wake anyone waiting in pop() ... and stop anyone waiting again
+		void close()
+		{
+			lock_guard<mutex> guard(lock_);
+			closed_ = true;
+			signal_.notify_all();
+		}
+
+		bool closed() const {
+			return closed_;
+		}
+
+		void push(std::shared_ptr<ISurface> const& surface)
+		{
+			if (surface)
+			{
+				lock_guard<mutex> guard(lock_);
+				queue_.push_back(surface);
+				size_.store(queue_.size(), memory_order_relaxed);
+				signal_.notify_all();
+			}
+		}
+
+		void push_all(vector<shared_ptr<ISurface>> const& surfaces)
+		{
+			lock_guard<mutex> guard(lock_);
+			for (auto const& s : surfaces) 
+			{
+				if (s) {
+					queue_.push_back(s);
+				}
+			}
+			size_.store(queue_.size(), memory_order_relaxed);
+			signal_.notify_all();
+		}
+
+		void pop_all(vector<shared_ptr<ISurface>>& surfaces)
+		{
+			lock_guard<mutex> guard(lock_);
+			surfaces.insert(surfaces.end(), queue_.begin(), queue_.end());
+			queue_.clear();
+			size_.store(0, memory_order_relaxed);
+		}
+
+		// a snapshot that doesn't need the lock
+		size_t size() const {
+			return size_.load(memory_order_relaxed);
+		}
+
+		bool try_pop(shared_ptr<ISurface>& surface)
+		{
+			lock_guard<mutex> guard(lock_);
+			if (queue_.empty()) {
+				return false;
+			}
+			surface = queue_.front();
+			queue_.pop_front();
+			size_.store(queue_.size(), memory_order_relaxed);
+			return true;
+		}
+
+		shared_ptr<ISurface> pop(uint32_t timeout_ms)
+		{
+			for (;;)
+			{
+				shared_ptr<ISurface> s;
+				if (try_pop(s)) {
+					return s;
+				}
+
+				unique_lock<mutex> lock(lock_);
+				if (!signal_.wait_for(lock, timeout_ms * 1ms,
+					[&]() { return closed_ || (queue_.size() > 0); }) || closed_) 
+				{
+					break;
+				}
+			}
+			return nullptr;
+		}
+	};
+
+	//
+	// bounded single-producer/single-consumer ring 
+	//
+	// push() never allocates or locks unless the other side is parked ...
+	// pop() spins for a short while before falling back to a 
+	// condition variable so a frame handoff is usually lock-free
+	//
+	class RingQueue
+	{
+	private:
+		vector<shared_ptr<ISurface>> slots_;
+		size_t const mask_;
+		atomic<size_t> head_; // next slot to read (consumer)
+		atomic<size_t> tail_; // next slot to write (producer)
+		atomic_bool parked_;
+		atomic_bool closed_;
+		condition_variable signal_;
+		mutex lock_;
+
+		// # of polls before we yield ... then park
+		static const uint32_t spin_count = 64;
+		static const uint32_t yield_count = 16;
+
+	public:
+		RingQueue(uint32_t capacity)
+			: slots_(round_up(capacity))
+			, mask_(slots_.size() - 1)
+			, head_(0)
+			, tail_(0)
+			, parked_(false)
+			, closed_(false)
+		{
+		}
+
+		void close()
+		{
+			lock_guard<mutex> guard(lock_);
+			closed_ = true;
+			signal_.notify_all();
+		}
+
+		bool closed() const {
+			return closed_;
+		}
+
+		void push(std::shared_ptr<ISurface> const& surface)
+		{
+			auto tail = tail_.load(memory_order_relaxed);
+			if (write(tail, surface)) {
+				publish(tail);
+			}
+		}
+
+		// publish a batch with a single tail update (and wake-up)
+		void push_all(vector<shared_ptr<ISurface>> const& surfaces)
+		{
+			auto tail = tail_.load(memory_order_relaxed);
+			auto const start = tail;
+			for (auto const& s : surfaces) {
+				write(tail, s);
+			}
+			if (tail != start) {
+				publish(tail);
+			}
+		}
+
+		// everything published so far
+		void pop_all(vector<shared_ptr<ISurface>>& surfaces)
+		{
+			auto head = head_.load(memory_order_relaxed);
+			auto const tail = tail_.load(memory_order_seq_cst);
+			for (; head != tail; ++head) {
+				surfaces.push_back(move(slots_[head & mask_]));
+			}
+			head_.store(head, memory_order_release);
+		}
+
+		shared_ptr<ISurface> pop(uint32_t timeout_ms)
+		{
+			shared_ptr<ISurface> surface;
+
+			for (uint32_t n = 0; n < (spin_count + yield_count); ++n)
+			{
+				if (try_pop(surface)) {
+					return surface;
+				}
+				if (closed_) {
+					return nullptr;
+				}
+				if (n >= spin_count) {
+					this_thread::yield();
+				}
+			}
+
+			unique_lock<mutex> lock(lock_);
+			parked_.store(true, memory_order_seq_cst);
+			signal_.wait_for(lock, timeout_ms * 1ms,
+				[&]() { return closed_ || try_pop(surface); });
+			parked_.store(false, memory_order_relaxed);
+			return closed_ ? nullptr : surface;
+		}
+
+		size_t size() const {
+			return tail_.load(memory_order_acquire) - head_.load(memory_order_acquire);
+		}
+
+		bool try_pop(shared_ptr<ISurface>& surface)
+		{
+			auto const head = head_.load(memory_order_relaxed);
+			if (head == tail_.load(memory_order_seq_cst)) {
+				return false;
+			}
+			surface = move(slots_[head & mask_]);
+			head_.store(head + 1, memory_order_release);
+			return true;
+		}
+
+	private:
+
+		// fill the slot at tail (not yet visible to the consumer)
+		bool write(size_t& tail, shared_ptr<ISurface> const& surface)
+		{
+			if (!surface) {
+				return false;
+			}
+
+			if ((tail - head_.load(memory_order_acquire)) > mask_)
+			{
+				// the ring is sized to hold every surface in circulation 
+				// so we should never get here
+				log_message("surface ring is full - dropping surface\n");
+				assert(0);
+				return false;
+			}
+
+			slots_[tail & mask_] = surface;
+			++tail;
+			return true;
+		}
+
+		void publish(size_t tail)
+		{
+			tail_.store(tail, memory_order_seq_cst);
+
+			// only take the lock if the consumer is (about to be) waiting
+			if (parked_.load(memory_order_seq_cst))
+			{
+				lock_guard<mutex> guard(lock_);
+				signal_.notify_one();
+			}
+		}
+
+		static size_t round_up(uint32_t capacity)
+		{
+			size_t n = 1;
+			while (n < capacity) {
+				n <<= 1;
+			}
+			return n;
+		}
+	};
+
+	//
+	// surface queue implementation for exchange - not specific
+	// to either Direct3D 9 or 11
+	//
+	template<class Lane>
+	class SurfaceQueue : public ISurfaceQueue, 
+						public enable_shared_from_this<SurfaceQueue<Lane>>
+	{
+	private:
+		Lane due_;
+		Lane pool_;
+		SurfaceDelivery const delivery_;
+		Counters counters_;
+		PoolSizer<Lane> sizer_;
+		Prioritizer priority_;
+		Signal signal_;
+		TimingCell timing_;
+
+	public:
+		SurfaceQueue(SurfaceQueueOptions const& options,
+			shared_ptr<ISurfaceAllocator> const& allocator)
+			: delivery_(options.delivery)
+			, sizer_(pool_, allocator, options.min_surfaces, options.max_surfaces)
+			, priority_(options.priority_burst) {
+		}
+
+		SurfaceQueue(SurfaceQueueOptions const& options, 
+			shared_ptr<ISurfaceAllocator> const& allocator,
+			uint32_t capacity)
+			: due_(capacity)
+			, pool_(capacity)
+			, delivery_(options.delivery)
+			, sizer_(pool_, allocator, options.min_surfaces, options.max_surfaces)
+			, priority_(options.priority_burst) {
+		}
+		
+		void produce(std::shared_ptr<ISurface> const& surface, 
+			SurfacePriority priority) override 
+		{
+			if (surface) {
+				stamp(surface, priority);
+				counters_.on_produce(surface);
+				priority_.on_produce(priority);
+			}
+			due_.push(surface);
+			signal_();
+		}
+
+		shared_ptr<ISurface> consume(uint32_t timeout_ms) override 
+		{
+			TRACE_ZONE("consume");
+			return next_surface(true, timeout_ms);
+		}
+
+		shared_ptr<ISurface> try_consume() override {
+			return next_surface(false, 0);
+		}
+
+		vector<shared_ptr<ISurface>> drain() override {
+			return drain_due(due_, sizer_, counters_, priority_);
+		}
+
+		// return a surface to the pool for re-use
+		// (consumers should call this when done with a surface they popped)
+		//
+		void checkin(std::shared_ptr<ISurface> const& surface) override 
+		{
+			pool_.push(surface);
+			signal_();
+		}
+
+		void checkin(vector<shared_ptr<ISurface>> const& surfaces) override 
+		{
+			pool_.push_all(surfaces);
+			signal_();
+		}
+
+		// get a free surface to the pool for writing
+		// (producers should call this when they want to render to a new surface)
+		//
+		shared_ptr<ISurface> checkout(uint32_t timeout_ms) override
+		{
+			TRACE_ZONE("checkout");
+			return pop_pool(pool_, sizer_, counters_, true, timeout_ms);
+		}
+
+		shared_ptr<ISurface> try_checkout() override {
+			return pop_pool(pool_, sizer_, counters_, false, 0);
+		}
+
+		void set_signal(function<void()> const& callback) override {
+			signal_.set(callback);
+		}
+
+		void close() override
+		{
+			due_.close();
+			pool_.close();
+			signal_();
+		}
+
+		bool is_closed() const override {
+			return pool_.closed();
+		}
+
+		// a plain queue only has a single consumer
+		shared_ptr<ISurfaceQueue> attach() override {
+			return this->shared_from_this();
+		}
+
+		void mark_vblank(uint64_t time) override {
+			timing_.mark(time);
+		}
+
+		ConsumerTiming consumer_timing() const override {
+			return timing_.load();
+		}
+
+		SurfaceQueueStats stats() const override {
+			return counters_.snapshot();
+		}
+
+	private:
+
+		shared_ptr<ISurface> next_surface(bool block, uint32_t timeout_ms)
+		{
+			if (due_.closed()) {
+				return nullptr;
+			}
+
+			// the producer gets skipped surfaces back immediately
+			auto const recycle = [this](shared_ptr<ISurface> const& s) {
+				priority_.pulled(s);
+				pool_.push(s);
+				signal_();
+			};
+
+			shared_ptr<ISurface> surf;
+			if (!priority_.holding())
+			{
+				surf = pop_due(due_, sizer_, counters_, block, timeout_ms);
+				if (!surf) {
+					return nullptr;
+				}
+
+				if (priority_.idle(surf)) {
+					return select_surface(due_, surf, delivery_, counters_, priority_, recycle);
+				}
+			}
+			return priority_.select(due_, surf, delivery_, counters_, recycle);
+		}
+	};
+
+	class FanoutEndpoint;
+
+	//
+	// surface queue that delivers each produced surface to every 
+	// attached consumer ... a surface is reference counted across 
+	// consumers and returns to the pool after the last checkin
+	//
+	class FanoutQueue : public ISurfaceQueue,
+						public enable_shared_from_this<FanoutQueue>
+	{
+	private:
+		struct Pending
+		{
+			shared_ptr<ISurface> surface;
+
+			// consumers that have yet to check the surface in
+			vector<FanoutEndpoint*> owners;
+		};
+
+		BlockingQueue pool_;
+		SurfaceDelivery const delivery_;
+		uint32_t const priority_burst_;
+		vector<FanoutEndpoint*> endpoints_;
+		vector<Pending> pending_;
+		mutex mutable lock_;
+		Counters counters_;
+
+		// consumer side totals of endpoints that have detached
+		SurfaceQueueStats detached_;
+
+		PoolSizer<BlockingQueue> sizer_;
+		Signal signal_;
+
+	public:
+		FanoutQueue(SurfaceQueueOptions const& options,
+			shared_ptr<ISurfaceAllocator> const& allocator)
+			: delivery_(options.delivery)
+			, priority_burst_(options.priority_burst)
+			, sizer_(pool_, allocator, options.min_surfaces, options.max_surfaces) {
+		}
+
+		void produce(std::shared_ptr<ISurface> const& surface,
+			SurfacePriority priority) override;
+
+		// the producer side has nothing to consume ... use attach()
+		shared_ptr<ISurface> consume(uint32_t) override 
+		{
+			assert(0);
+			return nullptr;
+		}
+
+		shared_ptr<ISurface> try_consume() override 
+		{
+			assert(0);
+			return nullptr;
+		}
+
+		vector<shared_ptr<ISurface>> drain() override 
+		{
+			assert(0);
+			return vector<shared_ptr<ISurface>>();
+		}
+
+		// surfaces given to the producer-side queue go straight to the pool
+		// (this is how the producer registers its render-targets)
+		//
+		void checkin(std::shared_ptr<ISurface> const& surface) override 
+		{
+			pool_.push(surface);
+			signal_();
+		}
+
+		void checkin(vector<shared_ptr<ISurface>> const& surfaces) override 
+		{
+			pool_.push_all(surfaces);
+			signal_();
+		}
+
+		// signals when the pool gets a surface back ... each consumer
+		// has its own signal for delivery
+		void set_signal(function<void()> const& callback) override {
+			signal_.set(callback);
+		}
+
+		// closes the whole pipeline ... producer and every consumer
+		void close() override;
+
+		bool is_closed() const override {
+			return pool_.closed();
+		}
+
+		shared_ptr<ISurface> checkout(uint32_t timeout_ms) override
+		{
+			TRACE_ZONE("checkout");
+			return pop_pool(pool_, sizer_, counters_, true, timeout_ms);
+		}
+
+		shared_ptr<ISurface> try_checkout() override {
+			return pop_pool(pool_, sizer_, counters_, false, 0);
+		}
+
+		shared_ptr<ISurfaceQueue> attach() override;
+
+		// the consumers report through their own endpoints
+		void mark_vblank(uint64_t) override {
+		}
+
+		// pace to the fastest consumer
+		ConsumerTiming consumer_timing() const override;
+
+		// the consumer side (consumed, dropped, consume waits ...) is summed
+		// over every consumer ... so a surface two of them consumed counts
+		// twice, and one only a single consumer skipped counts as dropped
+		SurfaceQueueStats stats() const override;
+
+		PoolSizer<BlockingQueue>& sizer() {
+			return sizer_;
+		}
+
+		//
+		// the consumer is done with a surface ... recycle once all
+		// consumers have released it
+		//
+		void release(FanoutEndpoint* owner, shared_ptr<ISurface> const& surface)
+		{
+			lock_guard<mutex> guard(lock_);
+			release_locked(owner, surface);
+		}
+
+		void release(FanoutEndpoint* owner, vector<shared_ptr<ISurface>> const& surfaces)
+		{
+			lock_guard<mutex> guard(lock_);
+			for (auto const& s : surfaces) {
+				release_locked(owner, s);
+			}
+		}
+
+		//
+		// consumer is going away ... release everything it still holds
+		// (and keep its totals)
+		//
+		void detach(FanoutEndpoint* owner, SurfaceQueueStats const& totals)
+		{
+			lock_guard<mutex> guard(lock_);
+
+			add_consumer_side(detached_, totals);
+
+			endpoints_.erase(
+				remove(endpoints_.begin(), endpoints_.end(), owner), endpoints_.end());
+
+			for (auto i = pending_.begin(); i != pending_.end(); )
+			{
+				i->owners.erase(
+					remove(i->owners.begin(), i->owners.end(), owner), i->owners.end());
+				if (i->owners.empty()) {
+					i = recycle(i);
+				}
+				else {
+					++i;
+				}
+			}
+		}
+
+	private:
+
+		void release_locked(FanoutEndpoint* owner, shared_ptr<ISurface> const& surface)
+		{
+			if (!surface) {
+				return;
+			}
+
+			for (auto i = pending_.begin(); i != pending_.end(); ++i)
+			{
+				if (i->surface == surface)
+				{
+					auto const o = find(i->owners.begin(), i->owners.end(), owner);
+					if (o != i->owners.end()) {
+						i->owners.erase(o);
+					}
+					if (i->owners.empty()) {
+						recycle(i);
+					}
+					break;
+				}
+			}
+		}
+
+		vector<Pending>::iterator recycle(vector<Pending>::iterator i)
+		{
+			pool_.push(i->surface);
+			signal_();
+			return pending_.erase(i);
+		}
+	};
+
+	//
+	// a single consumer's view of a fan-out queue
+	//
+	class FanoutEndpoint : public ISurfaceQueue
+	{
+	private:
+		shared_ptr<FanoutQueue> const parent_;
+		BlockingQueue due_;
+		SurfaceDelivery const delivery_;
+		Counters counters_;
+		Prioritizer priority_;
+		Signal signal_;
+		TimingCell timing_;
+
+	public:
+		FanoutEndpoint(shared_ptr<FanoutQueue> const& parent, 
+			SurfaceDelivery delivery,
+			uint32_t priority_burst)
+			: parent_(parent)
+			, delivery_(delivery)
+			, priority_(priority_burst) {
+		}
+
+		~FanoutEndpoint() {
+			parent_->detach(this, counters_.snapshot());
+		}
+
+		void deliver(shared_ptr<ISurface> const& surface) 
+		{
+			priority_.on_produce(surface->frame_info().priority);
+			due_.push(surface);
+			signal_();
+		}
+
+		void shutdown() 
+		{
+			due_.close();
+			signal_();
+		}
+
+		shared_ptr<ISurface> checkout(uint32_t timeout_ms) override {
+			return parent_->checkout(timeout_ms);
+		}
+
+		shared_ptr<ISurface> try_checkout() override {
+			return parent_->try_checkout();
+		}
+
+		void produce(std::shared_ptr<ISurface> const& surface, 
+			SurfacePriority priority) override {
+			parent_->produce(surface, priority);
+		}
+
+		shared_ptr<ISurface> consume(uint32_t timeout_ms) override
+		{
+			TRACE_ZONE("consume");
+			return next_surface(true, timeout_ms);
+		}
+
+		shared_ptr<ISurface> try_consume() override {
+			return next_surface(false, 0);
+		}
+
+		vector<shared_ptr<ISurface>> drain() override {
+			return drain_due(due_, parent_->sizer(), counters_, priority_);
+		}
+
+		void checkin(std::shared_ptr<ISurface> const& surface) override {
+			parent_->release(this, surface);
+		}
+
+		void checkin(vector<shared_ptr<ISurface>> const& surfaces) override {
+			parent_->release(this, surfaces);
+		}
+
+		void set_signal(function<void()> const& callback) override {
+			signal_.set(callback);
+		}
+
+		void close() override {
+			parent_->close();
+		}
+
+		bool is_closed() const override {
+			return due_.closed();
+		}
+
+		shared_ptr<ISurfaceQueue> attach() override {
+			return parent_->attach();
+		}
+
+		void mark_vblank(uint64_t time) override {
+			timing_.mark(time);
+		}
+
+		ConsumerTiming consumer_timing() const override {
+			return parent_->consumer_timing();
+		}
+
+		// this consumer's own timing
+		ConsumerTiming own_timing() const {
+			return timing_.load();
+		}
+
+		// this consumer's own counters
+		SurfaceQueueStats consumer_side() const {
+			return counters_.snapshot();
+		}
+
+		SurfaceQueueStats stats() const override
+		{
+			// the producer side belongs to the parent
+			auto const parent = parent_->stats();
+			auto stats = counters_.snapshot();
+			stats.produced = parent.produced;
+			for (size_t n = 0; n < surface_priorities; ++n) {
+				stats.lanes[n].produced = parent.lanes[n].produced;
+			}
+			stats.checkout_timeouts = parent.checkout_timeouts;
+			stats.checkout_wait = parent.checkout_wait;
+			stats.pool_depth = parent.pool_depth;
+			return stats;
+		}
+
+	private:
+
+		shared_ptr<ISurface> next_surface(bool block, uint32_t timeout_ms)
+		{
+			if (due_.closed()) {
+				return nullptr;
+			}
+
+			// only this consumer lets go of skipped surfaces ... 
+			// the others may still want them
+			auto const recycle = [this](shared_ptr<ISurface> const& s) { 
+				priority_.pulled(s);
+				parent_->release(this, s); 
+			};
+
+			shared_ptr<ISurface> surf;
+			if (!priority_.holding())
+			{
+				surf = pop_due(due_, parent_->sizer(), counters_, block, timeout_ms);
+				if (!surf) {
+					return nullptr;
+				}
+
+				if (priority_.idle(surf)) {
+					return select_surface(due_, surf, delivery_, counters_, priority_, recycle);
+				}
+			}
+			return priority_.select(due_, surf, delivery_, counters_, recycle);
+		}
+	};
+
+	void FanoutQueue::produce(
+		std::shared_ptr<ISurface> const& surface, SurfacePriority priority)
+	{
+		if (!surface) {
+			return;
+		}
+
+		stamp(surface, priority);
+		counters_.on_produce(surface);
+
+		lock_guard<mutex> guard(lock_);
+
+		// nobody is watching ... straight back to the pool
+		if (endpoints_.empty())
+		{
+			Counters::increment(counters_.dropped);
+			pool_.push(surface);
+			signal_();
+			return;
+		}
+
+		Pending pending;
+		pending.surface = surface;
+		pending.owners = endpoints_;
+		pending_.push_back(pending);
+
+		for (auto const& e : endpoints_) {
+			e->deliver(surface);
+		}
+	}
+
+	SurfaceQueueStats FanoutQueue::stats() const
+	{
+		auto stats = counters_.snapshot();
+
+		lock_guard<mutex> guard(lock_);
+		add_consumer_side(stats, detached_);
+		for (auto const& e : endpoints_) {
+			add_consumer_side(stats, e->consumer_side());
+		}
+		return stats;
+	}
+
+	shared_ptr<ISurfaceQueue> FanoutQueue::attach()
+	{
+		auto const endpoint = make_shared<FanoutEndpoint>(
+			shared_from_this(), delivery_, priority_burst_);
+
+		lock_guard<mutex> guard(lock_);
+		if (pool_.closed()) {
+			endpoint->shutdown();
+		}
+		endpoints_.push_back(endpoint.get());
+		return endpoint;
+	}
+
+	void FanoutQueue::close()
+	{
+		lock_guard<mutex> guard(lock_);
+		pool_.close();
+		for (auto const& e : endpoints_) {
+			e->shutdown();
+		}
+		signal_();
+	}
+
+	ConsumerTiming FanoutQueue::consumer_timing() const
+	{
+		ConsumerTiming fastest;
+
+		lock_guard<mutex> guard(lock_);
+		for (auto const& e : endpoints_)
+		{
+			auto const timing = e->own_timing();
+			if (timing.period && (!fastest.period || timing.period < fastest.period)) {
+				fastest = timing;
+			}
+		}
+		return fastest;
+	}
+}
+
+std::shared_ptr<ISurfaceQueue> create_surface_queue(
+	SurfaceQueueOptions const& options,
+	std::shared_ptr<ISurfaceAllocator> const& allocator)
+{
+	if (options.fanout) {
+		return make_shared<FanoutQueue>(options, allocator);
+	}
+
+	switch (options.type)
+	{
+		case SurfaceQueueType::ring:
+			// a ring has to be able to hold every surface we might allocate
+			return make_shared<SurfaceQueue<RingQueue>>(options, allocator, 
+				allocator ? max(options.capacity, options.max_surfaces) : options.capacity);
+
+		case SurfaceQueueType::locked:
+		default: 
+			return make_shared<SurfaceQueue<BlockingQueue>>(options, allocator);
+	}
+}
+
+void Histogram::add(uint64_t value)
+{
+	++counts[bucket_of(value)];
+	++count;
+	total += value;
+	if (value > max) {
+		max = value;
+	}
+}
+
+void Histogram::add(Histogram const& other)
+{
+	for (size_t b = 0; b < buckets; ++b) {
+		counts[b] += other.counts[b];
+	}
+	count += other.count;
+	total += other.total;
+	if (other.max > max) {
+		max = other.max;
+	}
+}
+
+void SampleWindow::add(uint64_t value)
+{
+	// the oldest sample is the one we're about to overwrite
+	if (samples.size() < capacity) {
+		samples.push_back(static_cast<double>(value));
+	}
+	else {
+		samples[count % capacity] = static_cast<double>(value);
+	}
+
+	++count;
+	total += value;
+	if (value > max) {
+		max = value;
+	}
+}
+
+double SampleWindow::mean() const {
+	return count ? total / double(count) : 0.0;
+}
+
+size_t Histogram::bucket_of(uint64_t value)
+{
+	size_t bucket = 0;
+	for (auto v = value; v && bucket < (buckets - 1); v >>= 1) {
+		++bucket;
+	}
+	return bucket;
+}
+
+double Histogram::mean() const {
+	return count ? (total / double(count)) : 0.0;
+}
+
+uint64_t Histogram::percentile(double p) const
+{
+	if (!count) {
+		return 0;
+	}
+
+	auto const rank = static_cast<uint64_t>(p * (count - 1) + 0.5);
+	uint64_t seen = 0;
+	for (size_t n = 0; n < buckets; ++n)
+	{
+		seen += counts[n];
+		if (seen > rank) {
+			auto const upper = n ? ((1ull << n) - 1) : 0ull;
+			return upper < max ? upper : max;
+		}
+	}
+	return max;
+}
+
+ConsumerTiming ConsumerTiming::update(uint64_t vblank) const
+{
+	ConsumerTiming timing = *this;
+	if (last && vblank > last)
+	{
+		auto interval = vblank - last;
+
+		// a long gap means the consumer stalled ... start over from here
+		if (interval < 250000)
+		{
+			// a missed vblank shows up as a multiple of the period
+			if (period) {
+				interval /= max<uint64_t>(1, (interval + period / 2) / period);
+			}
+			timing.period = period ? ((period * 7 + interval) / 8) : interval;
+		}
+	}
+	timing.last = vblank;
+	return timing;
+}
+
+uint64_t ConsumerTiming::next(uint64_t t) const
+{
+	if (!period || last >= t) {
+		return period ? last : t;
+	}
+	return last + ((t - last + period - 1) / period) * period;
+}
+
+ProducerPacer::ProducerPacer()
+	: cost_(0)
+	, start_(0) {
+}
+
+void ProducerPacer::begin(ConsumerTiming const& timing)
+{
+	auto const now = time_now();
+	if (timing.period)
+	{
+		// a consumer that stopped reporting gets a free-running cadence
+		// from now on ... we stay at its rate rather than spin
+		auto t = timing;
+		if (t.last > now || (now - t.last) > 250000) {
+			t.last = now;
+		}
+
+		auto const margin = t.period / 8;
+		auto const due = t.next(now + cost_ + margin);
+		wait_until(due - cost_ - margin);
+	}
+	start_ = time_now();
+}
+
+void ProducerPacer::end()
+{
+	// follow a slower frame right away but speed up gradually ... being
+	// early costs a little frame age, being late costs a whole vblank
+	auto const cost = time_now() - start_;
+	cost_ = (cost > cost_) ? cost : ((cost_ * 15 + cost) / 16);
+}
+
+FrameScheduler::FrameScheduler(double hz)
+	: period_(0.0)
+	, epoch_(0)
+	, frame_(0)
+	, missed_(0)
+{
+	set_rate(hz);
+}
+
+void FrameScheduler::set_rate(double hz)
+{
+	period_ = (hz > 0.0) ? (1000000.0 / hz) : 0.0;
+	epoch_ = 0;
+	frame_ = 0;
+}
+
+double FrameScheduler::rate() const {
+	return (period_ > 0.0) ? (1000000.0 / period_) : 0.0;
+}
+
+uint64_t FrameScheduler::wait()
+{
+	auto const now = time_now();
+	if (period_ <= 0.0) {
+		return now;
+	}
+
+	// the first frame (or one after a long stall) starts a new cadence
+	auto const due = epoch_ + static_cast<uint64_t>(++frame_ * period_ + 0.5);
+	if (!epoch_ || (now > due && (now - due) > 250000))
+	{
+		epoch_ = now;
+		frame_ = 0;
+		return now;
+	}
+
+	// a frame that ran long costs whole slots ... start late in the
+	// current one and stay in phase for the next
+	if (now > due)
+	{
+		auto const behind = static_cast<uint64_t>((now - due) / period_);
+		frame_ += behind;
+		missed_ += behind;
+		return epoch_ + static_cast<uint64_t>(frame_ * period_ + 0.5);
+	}
+
+	wait_until(due);
+	return due;
+}
+
+ConsumerMeter::ConsumerMeter()
+	: last_received_(0)
+	, last_frame_(-1ll)
+	, fresh_(false) {
+}
+
+void ConsumerMeter::consumed(shared_ptr<ISurface> const& surface, uint64_t wait)
+{
+	stats_.consume.add(wait);
+
+	fresh_ = (surface != nullptr);
+	if (!fresh_) {
+		return;
+	}
+
+	auto const now = time_now();
+	if (last_received_) {
+		stats_.interval.add(now - last_received_);
+	}
+	last_received_ = now;
+	++stats_.received;
+
+	// the producer numbers its frames ... anything we never saw between
+	// two we did was dropped on the way (or by the queue)
+	auto const frame = surface->frame_info().frame;
+	if (last_frame_ >= 0 && frame > last_frame_ + 1) {
+		stats_.dropped += static_cast<uint64_t>(frame - last_frame_ - 1);
+	}
+	if (frame >= 0) {
+		last_frame_ = frame;
+	}
+}
+
+void ConsumerMeter::copied(uint64_t time) {
+	stats_.copy.add(time);
 }
 
-std::shared_ptr<ISurfaceQueue> create_surface_queue()
+void ConsumerMeter::presented(uint64_t time)
 {
-	return make_shared<SurfaceQueue>();
+	stats_.present.add(time);
+	++stats_.presented;
+	if (!fresh_) {
+		++stats_.repeated;
+	}
+	fresh_ = false;
 }
\ No newline at end of file
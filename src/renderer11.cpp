@@ -3,10 +3,15 @@
 // found in the LICENSE file.
 
 #include "scene.h"
+#include "assets.h"
+#include "console.h"
+#include "fence.h"
 #include "util.h"
+#include "trace.h"
 
 #include "d3d11.h"
 #include <map>
+#include <vector>
 
 using namespace std;
 
@@ -22,21 +27,51 @@ namespace {
 		shared_ptr<d3d11::Effect> effect_;		
 		shared_ptr<ISurface> surface_;
 		shared_ptr<d3d11::Texture2D> staging_;
-		map<void*, shared_ptr<d3d11::Texture2D>> textures_;	
+
+		// textures we've opened ... keyed by share handle, but remember
+		// which surface it was as the producer may release and re-allocate
+		struct SharedTexture
+		{
+			weak_ptr<ISurface> surface;
+			shared_ptr<d3d11::Texture2D> texture;
+		};
+		map<void*, SharedTexture> textures_;
 
 		color bg_color_;
 		bool show_transparency_;
 
+		// producer -> present latency (ms) over the last second
+		vector<double> latency_;
+		uint64_t latency_start_;
+
+		// consume / copy / present timings ... drawn over the frame
+		ConsumerMeter meter_;
+		shared_ptr<IConsole> console_;
+		shared_ptr<d3d11::Texture2D> console_font_;
+		shared_ptr<d3d11::Geometry> console_geometry_;
+		ConsumerStats overlay_stats_;
+		uint64_t overlay_start_;
+
 	public:
 		Renderer(shared_ptr<d3d11::Device> const& device,
 			shared_ptr<d3d11::SwapChain> const& swapchain,
-			shared_ptr<ISurfaceQueue> const& queue)
+			shared_ptr<ISurfaceQueue> const& queue,
+			shared_ptr<IAssets> const& assets)
 			: device_(device)
 			, swapchain_(swapchain)
 			, queue_(queue)
+			, latency_start_(time_now())
+			, overlay_start_(0)
 		{
 			show_transparency_ = false;
 			bg_color_ = color(0.0f, 0.0f, .90f, 1.0f);
+
+			// no font (eg. the atlas wasn't generated) ... no overlay
+			auto const font = assets ? 
+				assets->load_font(assets->locate("console.atlas")) : nullptr;
+			if (font) {
+				console_ = create_console(font);
+			}
 		}
 
 		string gpu() const override {
@@ -69,6 +104,7 @@ namespace {
 
 		void render() override
 		{
+			TRACE_ZONE("render");
 			auto const ctx = device_->immedidate_context();
 
 			d3d11::ScopedBinder<d3d11::SwapChain> bind(ctx, swapchain_);
@@ -79,7 +115,16 @@ namespace {
 				geometry_ = device_->create_quad(0.0f, 0.0f, 1.0f, 1.0f, false);
 			}
 
-			auto const surface = queue_->consume(100);
+			// wait about a vblank for a new frame (when the producer runs on
+			// its own thread) ... otherwise show the last one again so the
+			// display keeps its cadence
+			auto const period = queue_->consumer_timing().period;
+			auto const timeout = period ? 
+				static_cast<uint32_t>(period / 1000 + 1) : 100u;
+
+			auto const consume_start = time_now();
+			auto const surface = queue_->consume(timeout);
+			meter_.consumed(surface, time_now() - consume_start);
 			if (surface)
 			{
 				surface_ = surface;
@@ -88,59 +133,273 @@ namespace {
 
 				shared_ptr<d3d11::Texture2D> texture;
 				auto const i = textures_.find(handle);
-				if (i != textures_.end()) 
+				if (i != textures_.end() && i->second.surface.lock() == surface) 
 				{
-					texture = i->second;
+					texture = i->second.texture;
 				}
 				else 
 				{
+					// forget textures for surfaces that no longer exist
+					for (auto t = textures_.begin(); t != textures_.end(); ) 
+					{
+						if (t->second.surface.expired()) {
+							t = textures_.erase(t);
+						}
+						else {
+							++t;
+						}
+					}
+
 					texture = device_->open_shared_texture(handle);
 					if (texture) {
-						textures_[handle] = texture;
+						textures_[handle] = { surface, texture };
 					}
 				}
 
-				if (geometry_ && texture)
+				if (texture)
 				{
-					// we need a shader
-					if (!effect_) {
-						effect_ = device_->create_default_effect();
-					}
-
 					if (!staging_)
 					{
 						staging_ = device_->create_dynamic_texture(
 							texture->width(), texture->height(), texture->format());
 					}
 
-					// bind our states/resource to the pipeline
-					d3d11::ScopedBinder<d3d11::Geometry> quad_binder(ctx, geometry_);
-					d3d11::ScopedBinder<d3d11::Effect> fx_binder(ctx, effect_);
-					d3d11::ScopedBinder<d3d11::Texture2D> tex_binder(ctx, staging_);
-
 					if (staging_)
 					{
+						auto const copy_start = time_now();
+
+						// the producer handed it off without waiting for
+						// its device to finish writing it
+						{
+							TRACE_ZONE("fence wait");
+							if (!wait_for_fence(surface, 1000)) {
+								log_message("timeout waiting for a surface fence\n");
+							}
+						}
+
 						staging_->copy_from(texture);
-						ctx->flush();
+
+						{
+							TRACE_ZONE("flush");
+							ctx->flush();
+						}
+						meter_.copied(time_now() - copy_start);
 					}
+				}
+			}
+
+			// staging holds the most recent frame we received
+			if (geometry_ && staging_)
+			{
+				// we need a shader
+				if (!effect_) {
+					effect_ = device_->create_default_effect();
+				}
 
-					// actually draw the quad
-					geometry_->draw();
-				}			
+				// bind our states/resource to the pipeline
+				d3d11::ScopedBinder<d3d11::Geometry> quad_binder(ctx, geometry_);
+				d3d11::ScopedBinder<d3d11::Effect> fx_binder(ctx, effect_);
+				d3d11::ScopedBinder<d3d11::Texture2D> tex_binder(ctx, staging_);
+
+				// actually draw the quad
+				geometry_->draw();
 			}
+
+			draw_overlay(ctx);
 		}
 
 		void present(int32_t sync_interval) override
 		{
+			TRACE_ZONE("present");
+			auto const start = time_now();
 			swapchain_->present(sync_interval);
+			meter_.presented(time_now() - start);
+
+			// a vsync'd present returns at the vblank (an unsynced one is
+			// on the render loop's own schedule) ... either way it's the
+			// cadence the producer wants to pace itself against
+			queue_->mark_vblank(time_now());
 
+			if (surface_) {
+				update_latency(surface_->frame_info());
+			}
+
+			// hand the surface back exactly once ... a consume() timeout
+			// must not re-queue the previous frame into the pool
 			queue_->checkin(surface_);
+			surface_.reset();
 		}
 
 		shared_ptr<ISurfaceQueue> queue() const {
 			return queue_;
 		}
 
+		ConsumerStats consumer_stats() const override {
+			return meter_.stats();
+		}
+
+	private:
+
+		//
+		// the consumer's own stats in the corner of the output ... the text
+		// (and its geometry) only changes a few times a second
+		//
+		void draw_overlay(shared_ptr<d3d11::Context> const& ctx)
+		{
+			if (!console_) {
+				return;
+			}
+
+			auto const now = time_now();
+			if (!overlay_start_ || (now - overlay_start_) >= 250000)
+			{
+				update_overlay(now);
+				overlay_start_ = now;
+			}
+
+			if (!console_font_)
+			{
+				auto const image = console_->font()->image();
+				if (image)
+				{
+					uint32_t stride = 0;
+					auto const pixels = image->lock(stride);
+					if (pixels) 
+					{
+						console_font_ = device_->create_texture(image->width(), 
+							image->height(), DXGI_FORMAT_B8G8R8A8_UNORM, pixels, stride);
+					}
+					image->unlock();
+				}
+			}
+
+			if (!console_font_ || !console_geometry_) {
+				return;
+			}
+
+			if (!effect_) {
+				effect_ = device_->create_default_effect();
+			}
+
+			d3d11::ScopedBinder<d3d11::Geometry> text_binder(ctx, console_geometry_);
+			d3d11::ScopedBinder<d3d11::Effect> fx_binder(ctx, effect_);
+			d3d11::ScopedBinder<d3d11::Texture2D> tex_binder(ctx, console_font_);
+			console_geometry_->draw();
+		}
+
+		void update_overlay(uint64_t now)
+		{
+			auto const& stats = meter_.stats();
+
+			// rates are since the last update ... timings are over the last
+			// SampleWindow::capacity frames
+			auto const elapsed = overlay_start_ ? (now - overlay_start_) / 1000000.0 : 0.0;
+			auto const presented = stats.presented - overlay_stats_.presented;
+			auto const received = stats.received - overlay_stats_.received;
+			overlay_stats_.presented = stats.presented;
+			overlay_stats_.received = stats.received;
+
+			console_->writelnf(0, "D3D11 : %dx%d", width(), height());
+			console_->writelnf(1, "fps   : %3.2f (%3.2f new)", 
+				elapsed > 0.0 ? presented / elapsed : 0.0,
+				elapsed > 0.0 ? received / elapsed : 0.0);
+			console_->writelnf(2, "frame : p50 %.2f, p99 %.2f ms", 
+				percentile(stats.interval.samples, 0.50) / 1000.0,
+				percentile(stats.interval.samples, 0.99) / 1000.0);
+			console_->writelnf(3, "wait  : p50 %.2f, p99 %.2f ms", 
+				percentile(stats.consume.samples, 0.50) / 1000.0,
+				percentile(stats.consume.samples, 0.99) / 1000.0);
+			console_->writelnf(4, "copy  : p50 %.2f, p99 %.2f ms", 
+				percentile(stats.copy.samples, 0.50) / 1000.0,
+				percentile(stats.copy.samples, 0.99) / 1000.0);
+			console_->writelnf(5, "pres  : p50 %.2f, p99 %.2f ms", 
+				percentile(stats.present.samples, 0.50) / 1000.0,
+				percentile(stats.present.samples, 0.99) / 1000.0);
+			console_->writelnf(6, "drop  : %I64u, repeat %I64u", 
+				stats.dropped, stats.repeated);
+
+			build_overlay();
+		}
+
+		//
+		// a quad per glyph in clip space, offset a little from the top-left
+		//
+		void build_overlay()
+		{
+			console_geometry_.reset();
+
+			auto const image = console_->font()->image();
+			auto const w = float(width());
+			auto const h = float(height());
+			if (!image || w <= 0.0f || h <= 0.0f) {
+				return;
+			}
+
+			auto const tw = float(image->width());
+			auto const th = float(image->height());
+
+			vector<d3d11::Vertex> vertices;
+			float y = 10.0f;
+			auto const line_count = console_->line_count();
+			for (int32_t line = 0; line < line_count; ++line)
+			{
+				float x = 10.0f;
+				auto const glyphs = console_->get_line(line);
+				for (auto const& glyph : glyphs)
+				{
+					auto const u0 = glyph->left / tw;
+					auto const v0 = glyph->top / th;
+					auto const u1 = (glyph->left + glyph->width) / tw;
+					auto const v1 = (glyph->top + glyph->height) / th;
+
+					auto const x0 = x / w * 2.0f - 1.0f;
+					auto const y0 = 1.0f - y / h * 2.0f;
+					auto const x1 = (x + glyph->width) / w * 2.0f - 1.0f;
+					auto const y1 = 1.0f - (y + glyph->height) / h * 2.0f;
+
+					vertices.push_back({ x0, y0, 1.0f, u0, v0 });
+					vertices.push_back({ x1, y0, 1.0f, u1, v0 });
+					vertices.push_back({ x0, y1, 1.0f, u0, v1 });
+					vertices.push_back({ x1, y0, 1.0f, u1, v0 });
+					vertices.push_back({ x1, y1, 1.0f, u1, v1 });
+					vertices.push_back({ x0, y1, 1.0f, u0, v1 });
+
+					x = x + glyph->width;
+				}
+
+				if (!glyphs.empty()) {
+					y = y + glyphs.front()->height;
+				}
+			}
+
+			console_geometry_ = device_->create_geometry(vertices);
+		}
+
+		//
+		// track how long it took from the producer's tick() until the
+		// frame was presented here ... report percentiles once a second
+		//
+		void update_latency(FrameInfo const& info)
+		{
+			auto const now = time_now();
+			if (info.ticked && info.ticked <= now) {
+				latency_.push_back((now - info.ticked) / 1000.0);
+			}
+
+			if ((now - latency_start_) >= 1000000)
+			{
+				if (!latency_.empty())
+				{
+					log_message("latency (ms): p50 %.2f, p95 %.2f, p99 %.2f, max %.2f\n",
+						percentile(latency_, 0.50),
+						percentile(latency_, 0.95),
+						percentile(latency_, 0.99),
+						percentile(latency_, 1.0));
+				}
+				latency_.clear();
+				latency_start_ = now;
+			}
+		}
 	};
 
 }
@@ -150,8 +409,26 @@ shared_ptr<IScene> create_consumer(
 	void* native_window, 
 	uint32_t width,
 	uint32_t height,
-	shared_ptr<IScene> const& producer)
+	shared_ptr<IScene> const& producer,
+	shared_ptr<IAssets> const& assets)
 {
+	// register with the producer's queue ... a fan-out queue will hand
+	// us our own view so every consumer sees every surface
+	return create_consumer(
+		native_window, width, height, producer->queue()->attach(), assets);
+}
+
+shared_ptr<IScene> create_consumer(
+	void* native_window, 
+	uint32_t width,
+	uint32_t height,
+	shared_ptr<ISurfaceQueue> const& queue,
+	shared_ptr<IAssets> const& assets)
+{
+	if (!queue) {
+		return nullptr;
+	}
+
 	auto const dev = d3d11::create_device();
 	if (!dev) {
 		return nullptr;
@@ -163,8 +440,7 @@ shared_ptr<IScene> create_consumer(
 		return nullptr;
 	}
 	
-	auto const consumer = make_shared<Renderer>(
-		dev, swapchain, producer->queue());
+	auto const consumer = make_shared<Renderer>(dev, swapchain, queue, assets);
 
 	string title("Direct3D 11 Consumer");
 	title.append(" - [gpu: ");
@@ -6,10 +6,15 @@
 #include "util.h"
 #include "assets.h"
 #include "console.h"
+#include "fence.h"
+#include "jobs.h"
+#include "trace.h"
 
 #include <d3d9.h>
 
 #include <vector>
+#include <mutex>
+#include <algorithm>
 #include <math.h>
 
 using namespace std;
@@ -122,7 +127,10 @@ namespace {
 	//
 	// manages offscreen render-target(s)
 	//
-	class FrameBuffer
+	// the surface queue decides how many shared targets we need and 
+	// allocates/releases them through us
+	//
+	class FrameBuffer : public ISurfaceAllocator
 	{
 	private:
 		std::shared_ptr<IDirect3DDevice9Ex> const device_;
@@ -135,22 +143,51 @@ namespace {
 
 		FrameBuffer(
 			shared_ptr<IDirect3DDevice9Ex> const device,
-			vector<shared_ptr<Texture2D>> const& buffers)
+			uint32_t width,
+			uint32_t height)
 			: device_(device)
-			, width_(0)
-			, height_(0)
+			, width_(width)
+			, height_(height)
 		{
-			buffers_.assign(buffers.begin(), buffers.end());
-
-			if (!buffers_.empty()) {
-				width_ = buffers.front()->width();
-				height_ = buffers.front()->height();			
-			}
 		}
 
 		uint32_t width() const { return width_; }
 		uint32_t height() const { return height_; }
 
+		//
+		// create a new shared render-target
+		//
+		shared_ptr<ISurface> allocate() override
+		{
+			HANDLE share = nullptr;
+			IDirect3DTexture9* texture = nullptr;
+			auto const hr = device_->CreateTexture(
+				width_, height_, 1,
+				D3DUSAGE_RENDERTARGET,
+				D3DFMT_A8R8G8B8,
+				D3DPOOL_DEFAULT,
+				&texture,
+				&share);
+			if (FAILED(hr)) {
+				return nullptr;
+			}
+
+			auto const buffer = make_shared<Texture2D>(device_, texture, share);
+			buffers_.push_back(buffer);
+			return buffer;
+		}
+
+		void release(shared_ptr<ISurface> const& surface) override
+		{
+			for (auto i = buffers_.begin(); i != buffers_.end(); ++i)
+			{
+				if (i->get() == surface.get()) {
+					buffers_.erase(i);
+					break;
+				}
+			}
+		}
+
 		shared_ptr<Texture2D> bind(void* target)
 		{
 			// save original render-target
@@ -264,138 +301,248 @@ namespace {
 		}
 	};
 
+	//
+	// the console's text as a quad per glyph ... only lines that changed
+	// since the last frame are rewritten, each into fresh space in a
+	// dynamic vertex buffer (D3DLOCK_NOOVERWRITE) until it runs out and
+	// the whole buffer is discarded and rewritten.  every line is drawn
+	// from wherever its latest vertices are with the same index pattern
+	//
 	class ConsoleGeometry
 	{
-	private:		
+	private:
+		// vertices (4 per glyph) and where they are in the vertex buffer
+		struct Line
+		{
+			vector<VERTEX> vertices;
+			uint32_t offset = 0;
+			bool dirty = false;
+		};
+
+		// output of build() waiting for upload()
+		struct LineUpdate
+		{
+			int32_t line;
+			vector<VERTEX> vertices;
+		};
+
+		// what build() last generated each line from
+		struct BuiltLine
+		{
+			uint32_t revision = 0;
+			float y = -1.0f;
+		};
+
 		uint32_t index_capacity_;
 		uint32_t vertex_capacity_;
-		uint32_t vertex_size_;
-		uint32_t triangles_;
+		uint32_t vertex_pos_;
 		
 		shared_ptr<IDirect3DIndexBuffer9> indices_;
 		shared_ptr<IDirect3DVertexBuffer9> vertices_;
 		shared_ptr<IDirect3DDevice9Ex> const device_;
 
+		vector<Line> lines_;
+
+		// only touched by build()
+		vector<BuiltLine> built_lines_;
+
+		// handed from build() to upload()
+		vector<LineUpdate> updates_;
+		int32_t line_count_;
+		bool built_;
+
 	public:
 		ConsoleGeometry(shared_ptr<IDirect3DDevice9Ex> const& device) 
 			: index_capacity_(0)
 			, vertex_capacity_(0)
-			, vertex_size_(0)
-			, triangles_(0)
-			, device_(device) {
+			, vertex_pos_(0)
+			, device_(device)
+			, line_count_(0)
+			, built_(false) {
 		}
 		
-		void update(shared_ptr<IConsole const> const& console)
+		//
+		// generate geometry for the console's lines that changed ... touches
+		// no D3D state, so it can run on any thread (but not alongside 
+		// upload()).  changes add to any a skipped upload() left pending
+		//
+		void build(shared_ptr<IConsole const> const& console)
 		{
+			built_ = true;
+
 			// to build geometry .. we need the font for the console
 			auto const font = console ? console->font() : nullptr;
 			if (!font) 
 			{
-				index_capacity_ = 0;
-				vertex_capacity_ = vertex_size_ = 0;
-				triangles_ = 0;
-				indices_.reset();
-				vertices_.reset();
+				updates_.clear();
+				line_count_ = 0;
 				return;
 			}			
 
-			// determine the max # of vertices the console will use
-			uint32_t chars = console->column_count() * console->line_count();
-			uint32_t vertices = chars * 4;
-			uint32_t indices = chars * 6;
-
-			create_buffers(vertices, indices);
-			if (!vertices_ || !indices_) {
-				return;
-			}
-
-			vertex_size_ = triangles_ = 0;
-
 			auto const image = font->image();
 			auto const width = image ? float(image->width()) : 0.0f;
 			auto const height = image ? float(image->height()) : 0.0f;
-						
-			void* p;
-			auto hr = vertices_->Lock(0, 0, (void**)&p, 0);
-			if (FAILED(hr)) {				
-				return;
-			}
-			
-			VERTEX* pvert = reinterpret_cast<VERTEX*>(p);
-			
-			hr = indices_->Lock(0, 0, (void**)&p, 0);
-			if (FAILED(hr)) {
-				vertices_->Unlock();
-				return;
-			}
-			
-			int32_t* pidx = reinterpret_cast<int32_t*>(p);
-			int32_t idx = 0;
 
 			D3DCOLOR color = 0xffffffff;
-			VERTEX* pv = pvert;
 
-			float x, y = 0;
-			auto const line_count = console->line_count();
-			for (int32_t line = 0; line < line_count; ++line)
+			line_count_ = console->line_count();
+			built_lines_.resize(line_count_);
+
+			updates_.erase(remove_if(updates_.begin(), updates_.end(),
+				[this](LineUpdate const& u) { return u.line >= line_count_; }), 
+				updates_.end());
+
+			float y = 0;
+			for (int32_t line = 0; line < line_count_; ++line)
 			{
-				x = 0.0f;
 				auto glyphs = console->get_line(line);
-				for (auto const& glyph : glyphs)
+
+				// a line moves if one above it changed height
+				auto& built = built_lines_[line];
+				auto const revision = console->line_revision(line);
+				if (built.revision != revision || built.y != y)
 				{
-					float u0 = glyph->left / width;
-					float v0 = glyph->top / height;
-					float u1 = (glyph->left + glyph->width) / width;
-					float v1 = (glyph->top + glyph->height) / height;
-					
-					pv->x = x; pv->y = y; pv->z = 0.0f;
-					pv->color = color;
-					pv->u = u0; pv->v = v0;
-					pv++;
-					
-					pv->x = x + glyph->width; pv->y = y; pv->z = 0.0f;
-					pv->color = color;
-					pv->u = u1; pv->v = v0;
-					pv++;
-
-					pv->x = x; pv->y = y + glyph->height; pv->z = 0.0f;
-					pv->color = color;
-					pv->u = u0; pv->v = v1;
-					pv++;
-
-					pv->x = x + glyph->width; pv->y = y + glyph->height; pv->z = 0.0f;
-					pv->color = color;
-					pv->u = u1; pv->v = v1;
-					pv++;
-
-					*pidx = idx;
-					*(pidx + 1) = idx + 1;
-					*(pidx + 2) = idx + 2;
-					*(pidx + 3) = idx + 1;
-					*(pidx + 4) = idx + 3;
-					*(pidx + 5) = idx + 2;
-
-					pidx += 6;
-					vertex_size_ += 4;
-					idx += 4;
-					triangles_ += 2;
-
-					x = x + glyph->width;
+					built.revision = revision;
+					built.y = y;
+
+					LineUpdate update;
+					update.line = line;
+					update.vertices.reserve(glyphs.size() * 4);
+
+					float x = 0.0f;
+					for (auto const& glyph : glyphs)
+					{
+						float u0 = glyph->left / width;
+						float v0 = glyph->top / height;
+						float u1 = (glyph->left + glyph->width) / width;
+						float v1 = (glyph->top + glyph->height) / height;
+
+						// center texels
+						float const x0 = x - 0.5f;
+						float const y0 = y - 0.5f;
+						float const x1 = x + glyph->width - 0.5f;
+						float const y1 = y + glyph->height - 0.5f;
+
+						update.vertices.push_back({ x0, y0, 0.0f, color, u0, v0 });
+						update.vertices.push_back({ x1, y0, 0.0f, color, u1, v0 });
+						update.vertices.push_back({ x0, y1, 0.0f, color, u0, v1 });
+						update.vertices.push_back({ x1, y1, 0.0f, color, u1, v1 });
+
+						x = x + glyph->width;
+					}
+
+					// newer than anything still pending for the line
+					auto const pending = find_if(updates_.begin(), updates_.end(),
+						[line](LineUpdate const& u) { return u.line == line; });
+					if (pending != updates_.end()) {
+						*pending = move(update);
+					}
+					else {
+						updates_.push_back(move(update));
+					}
 				}
 
 				if (!glyphs.empty()) {
 					y = y + glyphs.front()->height;
 				}
 			}
+		}
 
-			// center texels
-			pv = pvert;
-			for (uint32_t v = 0; v < vertex_size_; v++, pv++) {
-				pv->x -= 0.5f;
-				pv->y -= 0.5f;
+		//
+		// write the last build()'s changed lines into our buffers (on the 
+		// device's thread) ... nothing is locked when no text changed
+		//
+		void upload()
+		{
+			if (!built_) {
+				return;
+			}
+			built_ = false;
+
+			lines_.resize(line_count_);
+			for (auto& update : updates_) 
+			{
+				auto& line = lines_[update.line];
+				line.vertices = move(update.vertices);
+				line.dirty = true;
+			}
+			updates_.clear();
+
+			bool changed = false;
+			uint32_t total = 0;
+			uint32_t glyphs = 0;
+			for (auto const& line : lines_)
+			{
+				auto const size = static_cast<uint32_t>(line.vertices.size());
+				total += size;
+				glyphs = max(glyphs, size / 4);
+				changed = changed || line.dirty;
+			}
+
+			if (!changed) {
+				return;
+			}
+
+			// room for a few frames of changes before we have to discard
+			// (a new buffer marks every line dirty)
+			create_buffers(total * 4, glyphs);
+			if (!vertices_ || !indices_) {
+				return;
+			}
+
+			uint32_t dirty = 0;
+			for (auto const& line : lines_)
+			{
+				if (line.dirty) {
+					dirty += static_cast<uint32_t>(line.vertices.size());
+				}
+			}
+			if (!dirty) 
+			{
+				// only empty lines changed
+				for (auto& line : lines_) {
+					line.dirty = false;
+				}
+				return;
+			}
+
+			// no room for the changed lines ... start over with every line
+			DWORD flags = D3DLOCK_NOOVERWRITE;
+			if (vertex_pos_ + dirty > vertex_capacity_)
+			{
+				flags = D3DLOCK_DISCARD;
+				vertex_pos_ = 0;
+				dirty = total;
+				for (auto& line : lines_) {
+					line.dirty = true;
+				}
+			}
+
+			void* p;
+			auto const hr = vertices_->Lock(
+				vertex_pos_ * sizeof(VERTEX), dirty * sizeof(VERTEX), &p, flags);
+			if (FAILED(hr)) {
+				return;
+			}
+			
+			VERTEX* pvert = reinterpret_cast<VERTEX*>(p);
+			for (auto& line : lines_)
+			{
+				if (!line.dirty) {
+					continue;
+				}
+				line.dirty = false;
+				line.offset = vertex_pos_;
+
+				auto const size = static_cast<uint32_t>(line.vertices.size());
+				if (size) 
+				{
+					memcpy(pvert, line.vertices.data(), size * sizeof(VERTEX));
+					pvert += size;
+					vertex_pos_ += size;
+				}
 			}
 
-			indices_->Unlock();
 			vertices_->Unlock();				
 		}
 
@@ -407,26 +554,40 @@ namespace {
 				device_->SetTexture(0, *texture);
 				device_->SetIndices(indices_.get());
 				device_->SetStreamSource(0, vertices_.get(), 0, sizeof(VERTEX));
-				device_->DrawIndexedPrimitive(
-					D3DPT_TRIANGLELIST, 0, 0, vertex_size_, 0, triangles_);
+				for (auto const& line : lines_)
+				{
+					auto const size = static_cast<uint32_t>(line.vertices.size());
+					if (size && !line.dirty)
+					{
+						device_->DrawIndexedPrimitive(
+							D3DPT_TRIANGLELIST, line.offset, 0, size, 0, size / 2);
+					}
+				}
 			}
 		}
 
 	private:
 
-		void create_buffers(uint32_t vertices, uint32_t indices)
+		void create_buffers(uint32_t vertices, uint32_t glyphs)
 		{
 			HRESULT hr;
 			if (vertices > vertex_capacity_)
 			{
 				vertices_.reset();
 				vertex_capacity_ = vertices;
+				vertex_pos_ = 0;
+
+				// everything has to be written to the new buffer
+				for (auto& line : lines_) {
+					line.dirty = true;
+				}
+
 				if (vertex_capacity_ > 0)
 				{
 					IDirect3DVertexBuffer9* vb = nullptr;
 					hr = device_->CreateVertexBuffer(
 						vertex_capacity_ * sizeof(VERTEX),
-						D3DUSAGE_DYNAMIC,
+						D3DUSAGE_DYNAMIC | D3DUSAGE_WRITEONLY,
 						D3DFVF_XYZ | D3DFVF_DIFFUSE | D3DFVF_TEX1,
 						D3DPOOL_DEFAULT,
 						&vb,
@@ -437,22 +598,47 @@ namespace {
 				}
 			}
 
+			// the same 2 triangles per glyph for every line ... written once
+			// (rounded up so it isn't rebuilt for every longer line)
+			auto const indices = ((glyphs + 63) & ~63u) * 6;
 			if (indices > index_capacity_)
 			{
 				indices_.reset();
 				index_capacity_ = indices;
 				if (index_capacity_ > 0)
 				{
+					vector<uint16_t> pattern;
+					pattern.reserve(index_capacity_);
+					for (uint32_t idx = 0; idx < (index_capacity_ / 6) * 4; idx += 4)
+					{
+						pattern.push_back(static_cast<uint16_t>(idx));
+						pattern.push_back(static_cast<uint16_t>(idx + 1));
+						pattern.push_back(static_cast<uint16_t>(idx + 2));
+						pattern.push_back(static_cast<uint16_t>(idx + 1));
+						pattern.push_back(static_cast<uint16_t>(idx + 3));
+						pattern.push_back(static_cast<uint16_t>(idx + 2));
+					}
+
 					IDirect3DIndexBuffer9* ib = nullptr;
 					hr = device_->CreateIndexBuffer(
-						index_capacity_ * sizeof(int32_t),
-						D3DUSAGE_DYNAMIC,
-						D3DFMT_INDEX32,
+						index_capacity_ * sizeof(uint16_t),
+						D3DUSAGE_WRITEONLY,
+						D3DFMT_INDEX16,
 						D3DPOOL_DEFAULT,
 						&ib,
 						nullptr);
-					if (SUCCEEDED(hr)) {
-						indices_ = to_com_ptr(ib);
+					if (SUCCEEDED(hr)) 
+					{
+						void* p;
+						if (SUCCEEDED(ib->Lock(0, 0, &p, 0)))
+						{
+							memcpy(p, pattern.data(), pattern.size() * sizeof(uint16_t));
+							ib->Unlock();
+							indices_ = to_com_ptr(ib);
+						}
+						else {
+							ib->Release();
+						}
 					}
 				}
 			}
@@ -460,14 +646,127 @@ namespace {
 	};
 	
 
+	//
+	// event queries for QueryFence ... a fence hands its query back when
+	// it's released, so we aren't creating one every frame
+	//
+	class QueryPool
+	{
+	private:
+		// plenty for the frames in flight ... any more are let go
+		static const size_t max_free = 8;
+
+		shared_ptr<IDirect3DDevice9Ex> const device_;
+		mutex lock_;
+		vector<shared_ptr<IDirect3DQuery9>> free_;
+
+	public:
+		QueryPool(shared_ptr<IDirect3DDevice9Ex> const& device)
+			: device_(device) {
+		}
+
+		// null if the device can't do event queries
+		shared_ptr<IDirect3DQuery9> acquire()
+		{
+			{
+				lock_guard<mutex> lock(lock_);
+				if (!free_.empty())
+				{
+					auto const query = free_.back();
+					free_.pop_back();
+					return query;
+				}
+			}
+
+			IDirect3DQuery9* query = nullptr;
+			if (FAILED(device_->CreateQuery(D3DQUERYTYPE_EVENT, &query))) {
+				return nullptr;
+			}
+			return to_com_ptr<>(query);
+		}
+
+		// any thread ... the query may not have signaled yet, issuing it 
+		// again just moves it to the new end of the command stream
+		void release(shared_ptr<IDirect3DQuery9> const& query)
+		{
+			lock_guard<mutex> lock(lock_);
+			if (free_.size() < max_free) {
+				free_.push_back(query);
+			}
+		}
+	};
+
+	//
+	// an event query issued after a frame's draw calls ... signaled once
+	// the gpu gets that far (the device must be D3DCREATE_MULTITHREADED, as
+	// whoever waits polls it from their own thread)
+	//
+	class QueryFence : public IFence
+	{
+	private:
+		// polls that only give up the rest of our timeslice before a wait
+		// starts sleeping between them
+		static const uint32_t yield_polls = 32;
+
+		shared_ptr<QueryPool> const pool_;
+		shared_ptr<IDirect3DQuery9> const query_;
+
+	public:
+		QueryFence(shared_ptr<QueryPool> const& pool,
+				shared_ptr<IDirect3DQuery9> const& query)
+			: pool_(pool)
+			, query_(query) {
+		}
+
+		~QueryFence() {
+			pool_->release(query_);
+		}
+
+		bool signaled() const override {
+			return query_->GetData(NULL, 0, D3DGETDATA_FLUSH) != S_FALSE;
+		}
+
+		//
+		// there's no event to block on for a query ... the gpu is usually
+		// only a little behind, so we yield for a while and then back off 
+		// to sleeping rather than hold a core for a long wait
+		//
+		bool wait(uint32_t timeout_ms) override
+		{
+			auto const start = time_now();
+			for (uint32_t polls = 0; !signaled(); ++polls)
+			{
+				if ((time_now() - start) > timeout_ms * 1000ull) {
+					return false;
+				}
+
+				if (polls < yield_polls) {
+					SwitchToThread();
+				}
+				else {
+					Sleep(1);
+				}
+			}
+			return true;
+		}
+	};
+
 	class Renderer : public IScene
 	{
 	private:
+		// a frame still waiting to be shown this long (us) after its tick() 
+		// is stale ... a consumer can skip it if something newer is ready
+		static const uint64_t max_frame_age = 100000;
+
 		shared_ptr<IAssets> const assets_;
 		shared_ptr<IDirect3DDevice9Ex> const device_;
 		shared_ptr<FrameBuffer> const frame_buffer_;
 		shared_ptr<ISurfaceQueue> const queue_;
-		shared_ptr<IDirect3DQuery9> flush_query_;
+
+		// resolves our fences for a consumer that can't (null when the
+		// consumer waits on them itself)
+		shared_ptr<IFenceWaiter> const fence_waiter_;
+		shared_ptr<QueryPool> const queries_;
 		
 		shared_ptr<Quad> meter_quad_;
 		shared_ptr<Texture2D> meter_;
@@ -480,6 +779,8 @@ namespace {
 		
 		double spin_angle_;
 		int64_t frame_;
+		double time_;
+		uint64_t ticked_;
 		double fps_;
 		int64_t fps_start_;
 		int64_t fps_frame_;
@@ -491,21 +792,33 @@ namespace {
 		shared_ptr<ConsoleGeometry> console_geometry_;
 		shared_ptr<IConsole> console_;
 
+		// formats the console and builds its geometry off the render thread
+		// ... console_job_ is done once this frame's geometry is ready
+		shared_ptr<IJobSystem> const jobs_;
+		Job console_job_;
+
 	public:
 		Renderer(
 			shared_ptr<IAssets> const& assets,
 			shared_ptr<IDirect3DDevice9Ex> const& device,
 			shared_ptr<FrameBuffer> const& frame_buffer,
-			shared_ptr<ISurfaceQueue> const& queue)
+			shared_ptr<ISurfaceQueue> const& queue,
+			shared_ptr<IFenceWaiter> const& fence_waiter,
+			shared_ptr<IJobSystem> const& jobs)
 			: assets_(assets)
 			, device_(device)
 			, frame_buffer_(frame_buffer)
 			, queue_(queue)
+			, fence_waiter_(fence_waiter)
+			, queries_(make_shared<QueryPool>(device))
 			, frame_(-1ll)
+			, time_(0.0)
+			, ticked_(0)
 			, fps_(0.0)
 			, fps_start_(time_now())
 			, fps_frame_(0ll)
 			, console_geometry_(make_shared<ConsoleGeometry>(device))
+			, jobs_(jobs ? jobs : create_job_system(2))
 		{
 			spin_angle_ = 0.0;
 			device_->SetRenderState(D3DRS_LIGHTING, 0);
@@ -555,23 +868,41 @@ namespace {
 
 		void tick(double t) override
 		{
+			TRACE_ZONE("tick");
 			++frame_;
+			time_ = t;
+			ticked_ = time_now();
 
 			auto degrees = (t * 60.0);
 			spin_angle_ = (degrees * (PI / 180.0));
 
 			if (console_) 
 			{
-				console_->writelnf(0, "D3D9 : %dx%d", width(), height());				
-				
+				auto const console = console_;
+				auto const geometry = console_geometry_;
+				auto const w = width();
+				auto const h = height();
+				auto const frame = frame_;
+				auto const fps = fps_;
+
 				degrees = degrees - (floor(degrees / 360.0) * 360.0);
-				console_->writelnf(1, "angle: %03d\xc2\xb0", static_cast<uint32_t>(degrees));
-				
-				console_->writelnf(2, "time : %s", to_timecode(t).c_str());
-				console_->writelnf(3, "frame: %06I64d", frame_);				
-				console_->writelnf(4, "fps  : %3.2f", fps_);
 
-				console_geometry_->update(console_);
+				// runs after last frame's geometry ... which reads the console
+				auto const text = jobs_->run([=]() 
+				{
+					TRACE_ZONE("console text");
+					console->writelnf(0, "D3D9 : %dx%d", w, h);				
+					console->writelnf(1, "angle: %03d\xc2\xb0", static_cast<uint32_t>(degrees));
+					console->writelnf(2, "time : %s", to_timecode(t).c_str());
+					console->writelnf(3, "frame: %06I64d", frame);				
+					console->writelnf(4, "fps  : %3.2f", fps);
+				}, { console_job_ });
+
+				console_job_ = jobs_->run([=]()
+				{
+					TRACE_ZONE("console geometry");
+					geometry->build(console);
+				}, { text });
 			}
 		}
 		
@@ -583,6 +914,7 @@ namespace {
 
 		void render() override
 		{
+			TRACE_ZONE("render");
 			auto const target = queue_->checkout(100);
 			if (!target) {
 				return;
@@ -623,11 +955,26 @@ namespace {
 
 			device_->EndScene();
 
-			// ensure the D3D9 device is done writing to our texture buffer
-			flush();
+			// the consumer waits for the D3D9 device to finish writing to
+			// our texture buffer ... not us, so frames can be in flight
+			target->set_fence(issue_fence());
+
+			// let the consumer know what it is getting
+			FrameInfo info;
+			info.frame = frame_;
+			info.time = time_;
+			info.ticked = ticked_;
+			info.rendered = time_now();
+			info.deadline = ticked_ + max_frame_age;
+			target->set_frame_info(info);
 
 			// place on queue so a producer will be notified
-			queue_->produce(target);
+			if (fence_waiter_) {
+				fence_waiter_->submit(target);
+			}
+			else {
+				queue_->produce(target);
+			}
 
 			auto const now = time_now();
 			if ((now - fps_start_) >= 1000000)
@@ -640,6 +987,7 @@ namespace {
 
 		void present(int32_t) override
 		{
+			TRACE_ZONE("present");
 			device_->Present(nullptr, nullptr, nullptr, nullptr);
 		}
 
@@ -647,6 +995,10 @@ namespace {
 			return queue_;
 		}
 
+		ConsumerStats consumer_stats() const override {
+			return ConsumerStats();
+		}
+
 		//
 		// render the surface to our window swapchain so we can 
 		// preview it on-screen
@@ -693,41 +1045,29 @@ namespace {
 			}
 		}
 		
-		bool flush()
+		//
+		// marks the end of this frame's commands ... null if the device
+		// can't do event queries
+		//
+		shared_ptr<IFence> issue_fence()
 		{
-			if (!flush_query_)
-			{
-				IDirect3DQuery9* query = nullptr;
-				auto const hr = device_->CreateQuery(D3DQUERYTYPE_EVENT, &query);
-				if (SUCCEEDED(hr)) {
-					flush_query_ = to_com_ptr<>(query);
-				}
-			}
+			TRACE_ZONE("fence");
 
-			if (!flush_query_) {
-				return false;
-			}
-			if (FAILED(flush_query_->Issue(D3DISSUE_END))) {
-				return false;
+			auto const query = queries_->acquire();
+			if (!query) {
+				return nullptr;
 			}
 
-			auto const start = time_now();
-			uint32_t count = 1;
-			while (flush_query_->GetData(NULL, 0, D3DGETDATA_FLUSH) == S_FALSE)
-			{
-				if ((count % 2) == 0) {
-					Sleep(0);
-				}
-				++count;
+			auto const fence = make_shared<QueryFence>(queries_, query);
 
-				// no way this should take more than 1 second
-				if ((time_now() - start) > 1000000)
-				{
-					log_message("timeout waiting for D3D9 flush\n");
-					return false;
-				}
+			if (FAILED(query->Issue(D3DISSUE_END))) {
+				return nullptr;
 			}
-			return true;
+
+			// a poll with D3DGETDATA_FLUSH submits the commands (without
+			// waiting for them) ... so the gpu starts on them right away
+			fence->signaled();
+			return fence;
 		}
 
 		shared_ptr<Quad> create_quad(
@@ -827,9 +1167,15 @@ namespace {
 				meter_quad_->draw(meter_);
 			}
 
-			// draw the console
+			// draw the console ... the only point we need the tick() jobs done
 			if (console_geometry_) 
 			{
+				{
+					TRACE_ZONE("console wait");
+					jobs_->wait(console_job_);
+				}
+				console_geometry_->upload();
+
 				D3DMATRIX mtrans;
 				matrix_translation(mtrans, 10.0f, 10.0f, 0.0f);
 
@@ -951,7 +1297,7 @@ namespace {
 			0,
 			D3DDEVTYPE_HAL,
 			window,
-			D3DCREATE_HARDWARE_VERTEXPROCESSING,
+			D3DCREATE_HARDWARE_VERTEXPROCESSING | D3DCREATE_MULTITHREADED,
 			&pp,
 			nullptr,
 			&device);
@@ -967,30 +1313,11 @@ namespace {
 
 	shared_ptr<FrameBuffer> create_frame_buffer(
 		shared_ptr<IDirect3DDevice9Ex> const& device,
-		uint32_t buffers,
 		uint32_t width,
 		uint32_t height)
 	{
-		vector<std::shared_ptr<Texture2D>> textures;
-
-		for (size_t n = 0; n < buffers; n++)
-		{
-			HANDLE share = nullptr;
-			IDirect3DTexture9* texture = nullptr;
-			auto const hr = device->CreateTexture(
-				width, height, 1,
-				D3DUSAGE_RENDERTARGET,
-				D3DFMT_A8R8G8B8,
-				D3DPOOL_DEFAULT,
-				&texture,
-				&share);
-			if (SUCCEEDED(hr)) {
-				textures.push_back(make_shared<Texture2D>(device, texture, share));
-			}
-		}
-
-		if (!textures.empty()) {
-			return make_shared<FrameBuffer>(device, textures);
+		if (width && height) {
+			return make_shared<FrameBuffer>(device, width, height);
 		}
 		return nullptr;
 	}
@@ -998,27 +1325,42 @@ namespace {
 }
 
 shared_ptr<IScene> create_producer(
-	void* native_window, uint32_t width, uint32_t height, shared_ptr<IAssets> const& assets)
+	void* native_window, 
+	uint32_t width, 
+	uint32_t height, 
+	shared_ptr<IAssets> const& assets,
+	SurfaceQueueOptions const& queue_options,
+	shared_ptr<IJobSystem> const& jobs)
 {
 	auto const dev = create_device((HWND)native_window, width, height);
 	if (!dev) {
 		return nullptr;
 	}
 
-	// create shared buffers for delivery to a consumer
-	auto const swapchain = create_frame_buffer(dev, 3, width, height);
+	// manages the shared buffers for delivery to a consumer
+	auto const swapchain = create_frame_buffer(dev, width, height);
 	if (!swapchain) {
 		return nullptr;
 	}
 	
-	// notify the surface queue about the shared textures 
-	// we will be rendering to
-	auto const queue = create_surface_queue();
-	for (size_t n = 0; n < swapchain->buffer_count(); ++n) {
-		queue->checkin(swapchain->buffer(n));			
+	// the surface queue will size the pool of shared textures 
+	// we render to based on demand ... unless we're sharing them 
+	// with a consumer in another process
+	auto const queue = queue_options.share_name.empty() ?
+		create_surface_queue(queue_options, swapchain) :
+		create_shared_surface_queue(queue_options.share_name, 
+			SurfaceQueueRole::producer, queue_options, swapchain);
+	if (!queue || !swapchain->buffer_count()) {
+		return nullptr;
 	}
 	
-	auto const producer = make_shared<Renderer>(assets, dev, swapchain, queue);
+	// a consumer in another process can't poll our queries ... so they're
+	// resolved here before the surface is produced
+	auto const fence_waiter = queue_options.share_name.empty() ?
+		nullptr : create_fence_waiter(queue);
+
+	auto const producer = make_shared<Renderer>(
+		assets, dev, swapchain, queue, fence_waiter, jobs);
 	
 	string title("Direct3D 9 Producer");
 	title.append(" - [gpu: ");
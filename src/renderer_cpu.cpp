@@ -0,0 +1,317 @@
+// Copyright (c) 2018 Daktronics. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+//
+// cpu memory backend ... surfaces are plain system memory, the producer
+// draws with the cpu and the consumer copies each frame to its own
+// back buffer, so the whole pipeline runs without a gpu or a window
+//
+
+#include "scene.h"
+#include "fence.h"
+#include "util.h"
+#include "trace.h"
+
+#include <string.h>
+
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+namespace {
+
+	//
+	// 32-bit pixels in system memory ... the "share handle" is the pixel
+	// memory itself, so it only means something within this process
+	//
+	class Surface : public ISurface
+	{
+	private:
+		uint32_t const width_;
+		uint32_t const height_;
+		vector<uint32_t> pixels_;
+
+	public:
+		Surface(uint32_t width, uint32_t height)
+			: width_(width)
+			, height_(height)
+			, pixels_(width * height) {
+		}
+
+		uint32_t width() const override { return width_; }
+		uint32_t height() const override { return height_; }
+
+		void* share_handle() const override {
+			return const_cast<uint32_t*>(pixels_.data());
+		}
+
+		uint32_t* pixels() { return pixels_.data(); }
+	};
+
+	class Allocator : public ISurfaceAllocator
+	{
+	private:
+		uint32_t const width_;
+		uint32_t const height_;
+
+	public:
+		Allocator(uint32_t width, uint32_t height)
+			: width_(width)
+			, height_(height) {
+		}
+
+		shared_ptr<ISurface> allocate() override {
+			return make_shared<Surface>(width_, height_);
+		}
+
+		void release(shared_ptr<ISurface> const&) override {
+		}
+	};
+
+	uint32_t to_pixel(color const& c)
+	{
+		auto const channel = [](float v) {
+			return static_cast<uint32_t>(min(max(v, 0.0f), 1.0f) * 255.0f + 0.5f);
+		};
+		return (channel(c.a) << 24) | (channel(c.r) << 16) | (channel(c.g) << 8) | channel(c.b);
+	}
+
+	void fill(uint32_t* dst, uint32_t width, uint32_t x0, uint32_t y0,
+		uint32_t x1, uint32_t y1, uint32_t pixel)
+	{
+		for (auto y = y0; y < y1; ++y) {
+			fill_n(dst + (y * width) + x0, x1 - x0, pixel);
+		}
+	}
+
+	//
+	// draws a background and a bar that sweeps across once a second
+	//
+	class Producer : public IScene
+	{
+	private:
+		shared_ptr<ISurfaceQueue> const queue_;
+		uint32_t const width_;
+		uint32_t const height_;
+		uint32_t background_;
+
+		int64_t frame_;
+		double time_;
+		uint64_t ticked_;
+
+	public:
+		Producer(shared_ptr<ISurfaceQueue> const& queue, uint32_t width, uint32_t height)
+			: queue_(queue)
+			, width_(width)
+			, height_(height)
+			, background_(0xff000000)
+			, frame_(-1ll)
+			, time_(0.0)
+			, ticked_(0) {
+		}
+
+		string gpu() const override {
+			return "cpu";
+		}
+
+		uint32_t width() const override { return width_; }
+		uint32_t height() const override { return height_; }
+
+		void set_background(string const& bg) override {
+			background_ = to_pixel(parse_color(bg));
+		}
+
+		void tick(double t) override
+		{
+			TRACE_ZONE("tick");
+			++frame_;
+			time_ = t;
+			ticked_ = time_now();
+		}
+
+		void render() override
+		{
+			TRACE_ZONE("render");
+			auto const target = queue_->checkout(100);
+			if (!target) {
+				return;
+			}
+
+			// our writes are done by the time we produce ... but the fence
+			// keeps the consumer on the same path as a gpu producer's
+			auto const fence = create_cpu_fence();
+			target->set_fence(fence);
+
+			auto const pixels = static_cast<uint32_t*>(target->share_handle());
+			auto const w = min(width_, target->width());
+			auto const h = min(height_, target->height());
+			if (pixels && w && h)
+			{
+				fill(pixels, target->width(), 0, 0, w, h, background_);
+
+				auto const bar_w = max(w / 16, 1u);
+				auto const x = static_cast<uint32_t>(
+					(time_ - static_cast<int64_t>(time_)) * (w - bar_w));
+				fill(pixels, target->width(), x, h / 4, x + bar_w, h - h / 4, 0xffffffff);
+			}
+
+			// let the consumer know what it is getting
+			FrameInfo info;
+			info.frame = frame_;
+			info.time = time_;
+			info.ticked = ticked_;
+			info.rendered = time_now();
+			target->set_frame_info(info);
+
+			fence->signal();
+			queue_->produce(target);
+		}
+
+		void present(int32_t) override {
+		}
+
+		shared_ptr<ISurfaceQueue> queue() const override {
+			return queue_;
+		}
+
+		ConsumerStats consumer_stats() const override {
+			return ConsumerStats();
+		}
+	};
+
+	//
+	// copies each consumed frame into its own back buffer ... the cpu
+	// stand-in for the D3D11 consumer's texture copy
+	//
+	class Consumer : public IScene
+	{
+	private:
+		shared_ptr<ISurfaceQueue> const queue_;
+		shared_ptr<ISurface> surface_;
+		vector<uint32_t> back_buffer_;
+		uint32_t width_;
+		uint32_t height_;
+		ConsumerMeter meter_;
+
+	public:
+		Consumer(shared_ptr<ISurfaceQueue> const& queue)
+			: queue_(queue)
+			, width_(0)
+			, height_(0) {
+		}
+
+		string gpu() const override {
+			return "cpu";
+		}
+
+		uint32_t width() const override { return width_; }
+		uint32_t height() const override { return height_; }
+
+		void set_background(string const&) override {
+		}
+
+		void tick(double) override {
+		}
+
+		void render() override
+		{
+			TRACE_ZONE("render");
+
+			// same policy as the D3D11 consumer ... wait about a vblank
+			// for a new frame, otherwise keep showing the last one
+			auto const period = queue_->consumer_timing().period;
+			auto const timeout = period ?
+				static_cast<uint32_t>(period / 1000 + 1) : 100u;
+
+			auto const start = time_now();
+			auto const surface = queue_->consume(timeout);
+			meter_.consumed(surface, time_now() - start);
+			if (!surface) {
+				return;
+			}
+			surface_ = surface;
+
+			auto const pixels = static_cast<uint32_t const*>(surface->share_handle());
+			if (pixels)
+			{
+				auto const copy_start = time_now();
+				if (!wait_for_fence(surface, 1000)) {
+					log_message("timeout waiting for a surface fence\n");
+				}
+				width_ = surface->width();
+				height_ = surface->height();
+				back_buffer_.resize(width_ * height_);
+				memcpy(back_buffer_.data(), pixels, back_buffer_.size() * sizeof(uint32_t));
+				meter_.copied(time_now() - copy_start);
+			}
+		}
+
+		void present(int32_t sync_interval) override
+		{
+			TRACE_ZONE("present");
+			auto const start = time_now();
+
+			// there's no vsync ... a non-zero interval means the caller runs
+			// us on a display cadence (eg. a FrameScheduler), which is what
+			// the producer should pace itself against
+			if (sync_interval > 0) {
+				queue_->mark_vblank(time_now());
+			}
+
+			// hand the surface back exactly once
+			queue_->checkin(surface_);
+			surface_.reset();
+
+			meter_.presented(time_now() - start);
+		}
+
+		shared_ptr<ISurfaceQueue> queue() const override {
+			return queue_;
+		}
+
+		ConsumerStats consumer_stats() const override {
+			return meter_.stats();
+		}
+	};
+}
+
+shared_ptr<ISurfaceAllocator> create_cpu_surface_allocator(uint32_t width, uint32_t height)
+{
+	if (!width || !height) {
+		return nullptr;
+	}
+	return make_shared<Allocator>(width, height);
+}
+
+shared_ptr<IScene> create_cpu_producer(
+	uint32_t width,
+	uint32_t height,
+	SurfaceQueueOptions const& queue_options,
+	shared_ptr<ISurfaceAllocator> const& allocator)
+{
+	auto const surfaces = allocator ? allocator : create_cpu_surface_allocator(width, height);
+	if (!surfaces) {
+		return nullptr;
+	}
+
+	auto const queue = create_surface_queue(queue_options, surfaces);
+	if (!queue) {
+		return nullptr;
+	}
+	return make_shared<Producer>(queue, width, height);
+}
+
+shared_ptr<IScene> create_cpu_consumer(shared_ptr<IScene> const& producer)
+{
+	return producer ? create_cpu_consumer(producer->queue()->attach()) : nullptr;
+}
+
+shared_ptr<IScene> create_cpu_consumer(shared_ptr<ISurfaceQueue> const& queue)
+{
+	if (!queue) {
+		return nullptr;
+	}
+	return make_shared<Consumer>(queue);
+}
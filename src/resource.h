@@ -5,6 +5,7 @@
 #define IDR_APPLICATION             100
 
 #define ID_CLOCK_PAUSE              105
+#define ID_TRACE_SAVE               106
 
 #define ID_VIEW_ZOOM25              201
 #define ID_VIEW_ZOOM50              202
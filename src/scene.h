@@ -6,8 +6,68 @@
 
 #include <string>
 #include <memory>
+#include <vector>
+#include <functional>
 
 class IAssets;
+class IJobSystem;
+
+//
+// how urgently a produced surface should reach the consumer
+//
+enum class SurfacePriority
+{
+	// routine frames (eg. animation)
+	normal,
+
+	// consumed ahead of any pending normal surfaces (eg. overlays, alerts)
+	high
+};
+
+static const size_t surface_priorities = 2;
+
+//
+// describes the frame a surface holds ... filled in by the producer
+// (times are from time_now() unless noted)
+//
+struct FrameInfo
+{
+	int64_t frame = -1;
+
+	// scene time (seconds) passed to the producer's tick()
+	double time = 0.0;
+
+	uint64_t ticked = 0;
+	uint64_t rendered = 0;
+	uint64_t produced = 0;
+
+	// optional target presentation time (0 = none) ... consumers will
+	// skip a surface whose deadline has passed if a newer one is pending
+	uint64_t deadline = 0;
+
+	// set by produce()
+	SurfacePriority priority = SurfacePriority::normal;
+};
+
+//
+// signaled once the work that wrote a surface has completed (eg. on the
+// gpu) ... so a producer can hand a surface off without waiting for it
+//
+class IFence
+{
+public:
+	IFence() {}
+	virtual ~IFence() {}
+
+	virtual bool signaled() const = 0;
+
+	// false if it timed out
+	virtual bool wait(uint32_t timeout_ms) = 0;
+
+private:
+	IFence(IFence const&) = delete;
+	IFence& operator=(IFence const&) = delete;
+};
 
 //
 // surfaces (textures) are exchanged between producers and consumers
@@ -22,11 +82,151 @@ public:
 	virtual uint32_t height() const = 0;
 	virtual void* share_handle() const = 0;
 
+	// only the current owner (producer until produce(), then consumer)
+	// should touch the frame info
+	FrameInfo const& frame_info() const { return frame_info_; }
+	void set_frame_info(FrameInfo const& info) { frame_info_ = info; }
+
+	// completes the producer's writes ... null when they already have
+	// (same ownership rules as the frame info)
+	std::shared_ptr<IFence> const& fence() const { return fence_; }
+	void set_fence(std::shared_ptr<IFence> const& fence) { fence_ = fence; }
+
 private:
+	FrameInfo frame_info_;
+	std::shared_ptr<IFence> fence_;
+
 	ISurface(ISurface const&) = delete;
 	ISurface& operator=(ISurface const&) = delete;
 };
 
+//
+// creates surfaces on behalf of a surface queue so the # of surfaces 
+// in circulation can follow demand (only called from checkout(), or
+// while the queue is being created)
+//
+class ISurfaceAllocator
+{
+public:
+	ISurfaceAllocator() {}
+	virtual ~ISurfaceAllocator() {}
+
+	virtual std::shared_ptr<ISurface> allocate() = 0;
+
+	// the queue no longer uses the surface
+	virtual void release(std::shared_ptr<ISurface> const&) = 0;
+
+private:
+	ISurfaceAllocator(ISurfaceAllocator const&) = delete;
+	ISurfaceAllocator& operator=(ISurfaceAllocator const&) = delete;
+};
+
+//
+// log2 histogram ... bucket 0 counts zeros and bucket n counts 
+// values in [2^(n-1), 2^n)
+//
+struct Histogram
+{
+	static const size_t buckets = 24;
+
+	uint64_t counts[buckets] = {};
+	uint64_t count = 0;
+	uint64_t total = 0;
+	uint64_t max = 0;
+
+	// record a single value
+	void add(uint64_t value);
+
+	// fold in another histogram's samples
+	void add(Histogram const& other);
+
+	double mean() const;
+
+	// upper bound of the bucket holding the p (0.0 - 1.0) sample
+	uint64_t percentile(double p) const;
+
+	static size_t bucket_of(uint64_t value);
+};
+
+//
+// a timing taken every frame ... count, mean and max cover every sample,
+// and the most recent window of samples is kept exactly for percentiles
+// (see percentile() in util.h) of values that sit close together (eg. 
+// frame times), where Histogram's log2 buckets put them all in one bucket
+//
+struct SampleWindow
+{
+	static const size_t capacity = 512;
+
+	// the last capacity samples, in no particular order
+	std::vector<double> samples;
+
+	uint64_t count = 0;
+	uint64_t total = 0;
+	uint64_t max = 0;
+
+	void add(uint64_t value);
+
+	double mean() const;
+};
+
+//
+// the consumer's display cadence, as reported to its queue
+//
+struct ConsumerTiming
+{
+	// smoothed time between vblanks (microseconds) ... 0 until known
+	uint64_t period = 0;
+
+	// time of the most recent vblank
+	uint64_t last = 0;
+
+	// fold in a newly reported vblank
+	ConsumerTiming update(uint64_t vblank) const;
+
+	// the first vblank at or after t (t itself if the period isn't known)
+	uint64_t next(uint64_t t) const;
+};
+
+//
+// running totals for a surface queue
+//
+struct SurfaceQueueStats
+{
+	uint64_t produced = 0;
+	uint64_t consumed = 0;
+
+	// surfaces recycled without ever being consumed
+	uint64_t dropped = 0;
+
+	// consumed surfaces with a deadline ... split by whether 
+	// they were handed out before or after it
+	uint64_t late = 0;
+	uint64_t on_time = 0;
+
+	uint64_t checkout_timeouts = 0;
+	uint64_t consume_timeouts = 0;
+
+	// time (us) spent blocked in checkout() and consume()
+	Histogram checkout_wait;
+	Histogram consume_wait;
+
+	// # of surfaces waiting in the pool at checkout() and 
+	// pending consumption at consume()
+	Histogram pool_depth;
+	Histogram due_depth;
+
+	// per priority (index with SurfacePriority) ... queued is the time (us)
+	// from produce() until a consumer took the surface
+	struct Lane
+	{
+		uint64_t produced = 0;
+		uint64_t consumed = 0;
+		Histogram queued;
+	};
+	Lane lanes[surface_priorities];
+};
+
 //
 // we're using a queue to exchange work between producers and consumers
 //
@@ -40,7 +240,9 @@ public:
 	virtual std::shared_ptr<ISurface> checkout(uint32_t timeout_ms) = 0;
 
 	// mark a surface as ready for consumption (caller = producer)
-	virtual void produce(std::shared_ptr<ISurface> const&) = 0;	
+	// ... stamps FrameInfo::produced and FrameInfo::priority
+	virtual void produce(std::shared_ptr<ISurface> const&, 
+		SurfacePriority priority = SurfacePriority::normal) = 0;	
 	
 	// get next surface to be consumed (caller = consumer)
 	virtual std::shared_ptr<ISurface> consume(uint32_t timeout_ms) = 0;
@@ -48,11 +250,142 @@ public:
 	// surface can be de-allocated, or returned to a pool (caller = consumer)
 	virtual void checkin(std::shared_ptr<ISurface> const&) = 0;
 
+	// non-blocking checkout() and consume() ... nullptr if nothing is ready
+	virtual std::shared_ptr<ISurface> try_checkout() = 0;
+	virtual std::shared_ptr<ISurface> try_consume() = 0;
+
+	// take every pending surface at once, oldest first (caller = consumer)
+	virtual std::vector<std::shared_ptr<ISurface>> drain() = 0;
+
+	// return a batch of surfaces in one operation (caller = consumer)
+	virtual void checkin(std::vector<std::shared_ptr<ISurface>> const&) = 0;
+
+	// called whenever a surface may have become available to checkout() or
+	// consume() ... lets an executor resume waiters without parking a thread
+	// (runs on the thread that made the surface available, keep it short)
+	virtual void set_signal(std::function<void()> const&) = 0;
+
+	// wake everyone blocked in checkout()/consume() ... from then on they 
+	// (and the try_ variants) return nullptr right away
+	virtual void close() = 0;
+	virtual bool is_closed() const = 0;
+
+	// consumer: a presented frame reached the display at this time (eg. a
+	// vsync'd present() just returned) ... builds up consumer_timing()
+	virtual void mark_vblank(uint64_t time) = 0;
+
+	// producer: rate and phase of the consumer's display ... so it can 
+	// render just in time rather than as fast as it can
+	virtual ConsumerTiming consumer_timing() const = 0;
+
+	// register a consumer with the queue ... returns the queue the consumer
+	// should consume() from and checkin() to
+	virtual std::shared_ptr<ISurfaceQueue> attach() = 0;
+
+	virtual SurfaceQueueStats stats() const = 0;
+
 private:
 	ISurfaceQueue(ISurfaceQueue const&) = delete;
 	ISurfaceQueue& operator=(ISurfaceQueue const&) = delete;
 };
 
+//
+// paces a producer loop against consumer_timing() ... each frame starts
+// so it finishes just ahead of the consumer's next vblank, instead of
+// rendering flat out and then waiting in checkout()
+//
+class ProducerPacer
+{
+private:
+	// recent worst-case time from begin() to end() (microseconds)
+	uint64_t cost_;
+	uint64_t start_;
+
+public:
+	ProducerPacer();
+
+	// wait (if needed) before starting a frame
+	void begin(ConsumerTiming const&);
+
+	// the frame has been produced
+	void end();
+};
+
+//
+// fixed-rate clock for a render loop ... frame n is due at epoch + n * 
+// period, so rounding never accumulates into drift (59.94 Hz stays 59.94),
+// and a loop that falls behind skips the slots it missed rather than 
+// rushing to catch up
+//
+class FrameScheduler
+{
+private:
+	// microseconds per frame (0 = unpaced)
+	double period_;
+	uint64_t epoch_;
+	uint64_t frame_;
+	uint64_t missed_;
+
+public:
+	FrameScheduler(double hz = 0.0);
+
+	// frames per second (0 = unpaced) ... restarts the cadence
+	void set_rate(double hz);
+	double rate() const;
+
+	// wait for the start of the next frame ... returns its due time
+	uint64_t wait();
+
+	// # of frames skipped because the loop fell behind
+	uint64_t missed() const { return missed_; }
+};
+
+//
+// what a consumer saw, from its side of the queue (times are
+// microseconds)
+//
+struct ConsumerStats
+{
+	// presents ... and how many showed a new frame vs. the last one again
+	uint64_t presented = 0;
+	uint64_t received = 0;
+	uint64_t repeated = 0;
+
+	// gaps in the producer's frame numbers between frames we received
+	uint64_t dropped = 0;
+
+	// between frames received, blocked in consume(), copying a received
+	// frame out of the shared surface and in present()
+	SampleWindow interval;
+	SampleWindow consume;
+	SampleWindow copy;
+	SampleWindow present;
+};
+
+//
+// collects ConsumerStats on a consumer's render thread ... a few clock
+// reads and histogram bumps per frame, no locks
+//
+class ConsumerMeter
+{
+private:
+	ConsumerStats stats_;
+	uint64_t last_received_;
+	int64_t last_frame_;
+	bool fresh_;
+
+public:
+	ConsumerMeter();
+
+	// after consume() ... surface is null when it timed out
+	void consumed(std::shared_ptr<ISurface> const& surface, uint64_t wait);
+
+	void copied(uint64_t time);
+	void presented(uint64_t time);
+
+	ConsumerStats const& stats() const { return stats_; }
+};
+
 //
 // base class for both Producers and Consumers
 //
@@ -76,22 +409,142 @@ public:
 
 	virtual std::shared_ptr<ISurfaceQueue> queue() const = 0;
 
+	// a consumer's view of the frames it has shown (zeros for a producer)
+	// ... read on the render thread, or once it has stopped
+	virtual ConsumerStats consumer_stats() const = 0;
+
 private:
 	IScene(IScene const&) = delete;
 	IScene& operator=(IScene const&) = delete;
 };
 
 
-std::shared_ptr<ISurfaceQueue> create_surface_queue();
+//
+// selects the data structure backing each lane (due/pool) of a surface queue
+//
+enum class SurfaceQueueType
+{
+	// list guarded by a mutex + condition variable
+	locked,
+
+	// fixed-capacity single-producer/single-consumer ring ... waiters 
+	// spin briefly before parking on a condition variable
+	ring
+};
+
+//
+// controls which pending surface consume() hands out
+//
+enum class SurfaceDelivery
+{
+	// oldest produced surface first
+	fifo,
+
+	// newest produced surface wins ... older pending surfaces are
+	// recycled to the pool and counted as dropped
+	mailbox
+};
+
+struct SurfaceQueueOptions
+{
+	SurfaceQueueType type = SurfaceQueueType::locked;
+	SurfaceDelivery delivery = SurfaceDelivery::fifo;
+
+	// max # of surfaces a ring lane can hold (rounded up to a power of 2)
+	// ... must be at least the # of surfaces checked in to the queue
+	uint32_t capacity = 8;
+
+	// deliver every produced surface to all attached consumers ... a surface
+	// only returns to the pool once each of them has checked it in
+	// (lanes are always locked for a fan-out queue)
+	bool fanout = false;
+
+	// bounds on the # of surfaces in circulation for a queue with an
+	// allocator ... it grows while the producer is starved at the same time
+	// the consumer sits idle, and shrinks while surfaces go unused
+	uint32_t min_surfaces = 2;
+	uint32_t max_surfaces = 6;
+
+	// most high priority surfaces consume() hands out in a row while a
+	// normal surface is waiting ... so a flood of them can't starve it
+	uint32_t priority_burst = 4;
+
+	// name of a queue shared with a consumer in another process (see
+	// create_shared_surface_queue) ... empty for an in-process queue
+	std::string share_name;
+};
+
+std::shared_ptr<ISurfaceQueue> create_surface_queue(
+	SurfaceQueueOptions const& options = SurfaceQueueOptions(),
+	std::shared_ptr<ISurfaceAllocator> const& allocator = nullptr);
+
+//
+// which end of a cross-process surface queue this process is
+//
+enum class SurfaceQueueRole
+{
+	producer,
+	consumer
+};
+
+//
+// a surface queue shared between a producer and a consumer in different
+// processes ... the queue state lives in named shared memory and only 
+// share handles cross over, never pixels
+//
+// the producer can exit (or crash) and start again without disturbing
+// the consumer, which picks up the new surfaces on the next consume()
+//
+// the producer shares max_surfaces surfaces from the allocator for its 
+// lifetime (no adaptive sizing, no mailbox or fan-out) ... returns 
+// nullptr if the role is already taken
+//
+std::shared_ptr<ISurfaceQueue> create_shared_surface_queue(
+	std::string const& name,
+	SurfaceQueueRole role,
+	SurfaceQueueOptions const& options = SurfaceQueueOptions(),
+	std::shared_ptr<ISurfaceAllocator> const& allocator = nullptr);
 
 std::shared_ptr<IScene> create_producer(
 	void* native_window, 
 	uint32_t width, 
 	uint32_t height,
-	std::shared_ptr<IAssets> const& assets);
+	std::shared_ptr<IAssets> const& assets,
+	SurfaceQueueOptions const& queue_options = SurfaceQueueOptions(),
+	std::shared_ptr<IJobSystem> const& jobs = nullptr);
 
 std::shared_ptr<IScene> create_consumer(
 	void* native_window,
 	uint32_t width,
 	uint32_t height,
-	std::shared_ptr<IScene> const& producer);
\ No newline at end of file
+	std::shared_ptr<IScene> const& producer,
+	std::shared_ptr<IAssets> const& assets = nullptr);
+
+// consume from a queue directly (eg. one shared with another process)
+// ... with assets, the consumer draws its stats over the output
+std::shared_ptr<IScene> create_consumer(
+	void* native_window,
+	uint32_t width,
+	uint32_t height,
+	std::shared_ptr<ISurfaceQueue> const& queue,
+	std::shared_ptr<IAssets> const& assets = nullptr);
+
+//
+// cpu memory backend ... surfaces are system memory and the scenes draw
+// with the cpu, so a pipeline can run without a gpu or a window (eg. for
+// headless benchmarks)
+//
+std::shared_ptr<ISurfaceAllocator> create_cpu_surface_allocator(
+	uint32_t width, 
+	uint32_t height);
+
+// surfaces come from the cpu allocator unless one is given ... there's no
+// cross-process sharing (share_name is ignored)
+std::shared_ptr<IScene> create_cpu_producer(
+	uint32_t width,
+	uint32_t height,
+	SurfaceQueueOptions const& queue_options = SurfaceQueueOptions(),
+	std::shared_ptr<ISurfaceAllocator> const& allocator = nullptr);
+
+std::shared_ptr<IScene> create_cpu_consumer(std::shared_ptr<IScene> const& producer);
+std::shared_ptr<IScene> create_cpu_consumer(std::shared_ptr<ISurfaceQueue> const& queue);
\ No newline at end of file
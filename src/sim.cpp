@@ -0,0 +1,350 @@
+// Copyright (c) 2018 Daktronics. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+//
+// trace-driven simulator for the surface queue ... a producer with a
+// given render cost and a consumer locked to a vsync period exchange
+// no-op surfaces in real time, and we report what the display would
+// have seen for each queue policy and pool size
+//
+// timing comes from a trace file (one frame per line):
+//
+//   # render_ms vsync_ms
+//   4.2 16.667
+//   21.0 16.667
+//
+// or is generated from --render, --jitter and --hz ... --pace has the
+// producer render just in time using the consumer's reported vblanks and
+// --urgent=N produces every Nth frame with high priority
+//
+
+#include "scene.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <fstream>
+#include <random>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <chrono>
+
+using namespace std;
+
+namespace {
+
+	class NullSurface : public ISurface
+	{
+	public:
+		uint32_t width() const override { return 0; }
+		uint32_t height() const override { return 0; }
+		void* share_handle() const override { return nullptr; }
+	};
+
+	//
+	// timing for a single frame (microseconds)
+	//
+	struct TraceFrame
+	{
+		uint64_t render;
+		uint64_t vsync;
+	};
+
+	vector<TraceFrame> load_trace(string const& filename)
+	{
+		vector<TraceFrame> trace;
+		ifstream file(filename);
+		string line;
+		while (getline(file, line))
+		{
+			line = trim(line);
+			if (line.empty() || line[0] == '#') {
+				continue;
+			}
+
+			double render_ms = 0.0;
+			double vsync_ms = 0.0;
+			if (sscanf(line.c_str(), "%lf %lf", &render_ms, &vsync_ms) == 2) {
+				trace.push_back({
+					static_cast<uint64_t>(render_ms * 1000.0),
+					static_cast<uint64_t>(vsync_ms * 1000.0) });
+			}
+		}
+		return trace;
+	}
+
+	//
+	// render cost is uniform in [render - jitter, render + jitter] ... the
+	// same seed every run so each policy sees an identical trace
+	//
+	vector<TraceFrame> generate_trace(
+		uint32_t frames, double render_ms, double jitter_ms, double hz)
+	{
+		mt19937 rng(9211);
+		uniform_real_distribution<double> jitter(-jitter_ms, jitter_ms);
+
+		vector<TraceFrame> trace;
+		for (uint32_t n = 0; n < frames; ++n)
+		{
+			auto const render = max(0.0, render_ms + jitter(rng));
+			trace.push_back({
+				static_cast<uint64_t>(render * 1000.0),
+				static_cast<uint64_t>(1000000.0 / hz) });
+		}
+		return trace;
+	}
+
+	struct SimResult
+	{
+		double fps;
+		double latency_p50;
+		double latency_p95;
+		double latency_p99;
+		uint64_t produced;
+		uint64_t displayed;
+		// never shown vs. shown after their deadline
+		uint64_t dropped;
+		uint64_t late;
+		uint64_t repeats;
+		double producer_blocked;
+		double urgent_p99;
+	};
+
+	//
+	// producer renders flat out (like the preview with present(0)) ...
+	// consumer swaps in whatever is due at each vblank and holds it until
+	// the next, as a flip would
+	//
+	SimResult run(
+		SurfaceQueueOptions const& options,
+		uint32_t surfaces,
+		vector<TraceFrame> const& trace,
+		double scale,
+		uint64_t max_age,
+		bool pace,
+		uint32_t urgent)
+	{
+		auto const queue = create_surface_queue(options);
+		for (uint32_t n = 0; n < surfaces; ++n) {
+			queue->checkin(make_shared<NullSurface>());
+		}
+
+		atomic_bool done(false);
+		atomic<uint64_t> blocked(0);
+
+		auto const start = time_now();
+
+		thread producer([&]()
+		{
+			ProducerPacer pacer;
+			for (uint64_t n = 0; !done; ++n)
+			{
+				if (pace) {
+					pacer.begin(queue->consumer_timing());
+				}
+
+				auto const t = time_now();
+				auto const target = queue->checkout(100);
+				blocked += (time_now() - t);
+				if (!target) {
+					continue;
+				}
+
+				FrameInfo info;
+				info.frame = static_cast<int64_t>(n);
+				info.ticked = time_now();
+				info.deadline = max_age ? (info.ticked + max_age) : 0;
+
+				auto const& frame = trace[n % trace.size()];
+				wait_until(info.ticked + static_cast<uint64_t>(frame.render * scale));
+
+				info.rendered = time_now();
+				target->set_frame_info(info);
+				queue->produce(target, (urgent && (n % urgent) == 0) ?
+					SurfacePriority::high : SurfacePriority::normal);
+
+				if (pace) {
+					pacer.end();
+				}
+			}
+		});
+
+		vector<double> latency;
+		uint64_t repeats = 0;
+		shared_ptr<ISurface> scanout;
+
+		auto vblank = start;
+		for (auto const& frame : trace)
+		{
+			vblank += static_cast<uint64_t>(frame.vsync * scale);
+			wait_until(vblank);
+			queue->mark_vblank(vblank);
+
+			auto const surface = queue->try_consume();
+			if (surface)
+			{
+				latency.push_back((time_now() - surface->frame_info().ticked) / (1000.0 * scale));
+				queue->checkin(scanout);
+				scanout = surface;
+			}
+			else {
+				++repeats;
+			}
+		}
+
+		done = true;
+		queue->close();
+		producer.join();
+
+		auto const elapsed = time_now() - start;
+		auto const stats = queue->stats();
+
+		SimResult result;
+		result.fps = latency.size() * 1000000.0 / (elapsed / scale);
+		result.latency_p50 = percentile(latency, 0.50);
+		result.latency_p95 = percentile(latency, 0.95);
+		result.latency_p99 = percentile(latency, 0.99);
+		result.produced = stats.produced;
+		result.displayed = latency.size();
+		result.dropped = stats.dropped;
+		result.late = stats.late;
+		result.repeats = repeats;
+		result.producer_blocked = blocked * 100.0 / elapsed;
+		result.urgent_p99 = stats.lanes[static_cast<size_t>(SurfacePriority::high)]
+			.queued.percentile(0.99) / (1000.0 * scale);
+		return result;
+	}
+
+	const char* to_string(SurfaceQueueType type)
+	{
+		switch (type)
+		{
+			case SurfaceQueueType::ring: return "ring";
+			case SurfaceQueueType::locked:
+			default: return "locked";
+		}
+	}
+
+	const char* to_string(SurfaceDelivery delivery)
+	{
+		switch (delivery)
+		{
+			case SurfaceDelivery::mailbox: return "mailbox";
+			case SurfaceDelivery::fifo:
+			default: return "fifo";
+		}
+	}
+
+	double to_double(char const* value, double default_val)
+	{
+		char* end = nullptr;
+		auto const d = strtod(value, &end);
+		return (end != value) ? d : default_val;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	string trace_file;
+	uint32_t frames = 120;
+	double render_ms = 12.0;
+	double jitter_ms = 8.0;
+	double hz = 60.0;
+	double scale = 1.0;
+	double max_age_ms = 0.0;
+	bool pace = false;
+	uint32_t urgent = 0;
+	for (int n = 1; n < argc; ++n)
+	{
+		if (strncmp(argv[n], "--trace=", 8) == 0) {
+			trace_file = argv[n] + 8;
+		}
+		else if (strncmp(argv[n], "--frames=", 9) == 0) {
+			frames = to_int(argv[n] + 9, frames);
+		}
+		else if (strncmp(argv[n], "--render=", 9) == 0) {
+			render_ms = to_double(argv[n] + 9, render_ms);
+		}
+		else if (strncmp(argv[n], "--jitter=", 9) == 0) {
+			jitter_ms = to_double(argv[n] + 9, jitter_ms);
+		}
+		else if (strncmp(argv[n], "--hz=", 5) == 0) {
+			hz = to_double(argv[n] + 5, hz);
+		}
+		else if (strncmp(argv[n], "--scale=", 8) == 0) {
+			// < 1 runs the trace faster than real time
+			scale = max(0.01, to_double(argv[n] + 8, scale));
+		}
+		else if (strncmp(argv[n], "--max-age=", 10) == 0) {
+			max_age_ms = to_double(argv[n] + 10, max_age_ms);
+		}
+		else if (strcmp(argv[n], "--pace") == 0) {
+			pace = true;
+		}
+		else if (strncmp(argv[n], "--urgent=", 9) == 0) {
+			urgent = to_int(argv[n] + 9, urgent);
+		}
+	}
+
+	auto const trace = trace_file.empty() ?
+		generate_trace(frames, render_ms, jitter_ms, hz) : load_trace(trace_file);
+	if (trace.empty()) {
+		printf("no frames in trace '%s'\n", trace_file.c_str());
+		return 1;
+	}
+
+	if (trace_file.empty()) {
+		printf("%u frames, render %.1f +/- %.1f ms, %.1f Hz",
+			frames, render_ms, jitter_ms, hz);
+	}
+	else {
+		printf("%u frames from '%s'",
+			static_cast<uint32_t>(trace.size()), trace_file.c_str());
+	}
+	printf(", time scale %.2f%s\n\n", scale, pace ? ", paced producer" : "");
+
+	printf("%-7s %-8s %5s %7s %8s %8s %8s %8s %8s %8s %8s %8s %s\n",
+		"queue", "delivery", "pool", "fps", "p50 ms", "p95 ms", "p99 ms",
+		"produced", "dropped", "late", "repeats", "blocked%", urgent ? "  high queued p99 ms" : "");
+
+	SurfaceQueueType const types[] = {
+		SurfaceQueueType::locked, SurfaceQueueType::ring };
+	SurfaceDelivery const deliveries[] = {
+		SurfaceDelivery::fifo, SurfaceDelivery::mailbox };
+	uint32_t const pool_sizes[] = { 2, 3, 4, 6 };
+
+	for (auto const type : types)
+	{
+		for (auto const delivery : deliveries)
+		{
+			for (auto const surfaces : pool_sizes)
+			{
+				SurfaceQueueOptions options;
+				options.type = type;
+				options.delivery = delivery;
+
+				auto const r = run(options, surfaces, trace, scale,
+					static_cast<uint64_t>(max_age_ms * 1000.0 * scale), pace, urgent);
+
+				printf("%-7s %-8s %5u %7.1f %8.2f %8.2f %8.2f %8llu %8llu %8llu %8llu %8.1f",
+					to_string(type), to_string(delivery), surfaces, r.fps,
+					r.latency_p50, r.latency_p95, r.latency_p99,
+					static_cast<unsigned long long>(r.produced),
+					static_cast<unsigned long long>(r.dropped),
+					static_cast<unsigned long long>(r.late),
+					static_cast<unsigned long long>(r.repeats),
+					r.producer_blocked);
+				if (urgent) {
+					printf(" %20.2f", r.urgent_p99);
+				}
+				printf("\n");
+			}
+		}
+	}
+
+	return 0;
+}
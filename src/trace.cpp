@@ -0,0 +1,258 @@
+// Copyright (c) 2018 Daktronics. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+#include "trace.h"
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+atomic_bool trace_enabled_(false);
+
+namespace {
+
+	//
+	// a thread's most recent zones ... only the owning thread writes,
+	// and it publishes each zone by bumping written_ (release), so a
+	// reader can copy without stopping it
+	//
+	// every field is a relaxed atomic, so a reader racing the writer
+	// around the ring sees stale or new values (never torn ones) ... and
+	// anything the writer may have lapped is thrown away (see snapshot)
+	//
+	class ThreadBuffer
+	{
+	public:
+		// ~1 MB per thread ... many seconds of zones at a few per frame
+		static const size_t capacity = 32768;
+
+		struct Event
+		{
+			atomic<const char*> name;
+			atomic<uint64_t> start;
+			atomic<uint64_t> end;
+		};
+
+		struct Zone
+		{
+			const char* name;
+			uint64_t start;
+			uint64_t end;
+		};
+
+	private:
+		unique_ptr<Event[]> events_;
+		atomic<uint64_t> written_;
+
+		uint32_t const id_;
+		mutable mutex name_lock_;
+		string name_;
+
+	public:
+		// the events are allocated on the first record() ... threads that
+		// are only named (eg. while tracing is off) cost next to nothing
+		ThreadBuffer(uint32_t id)
+			: written_(0)
+			, id_(id) {
+		}
+
+		uint32_t id() const { return id_; }
+
+		void set_name(string const& name)
+		{
+			lock_guard<mutex> guard(name_lock_);
+			name_ = name;
+		}
+
+		string name() const
+		{
+			lock_guard<mutex> guard(name_lock_);
+			return name_;
+		}
+
+		// owning thread only
+		void record(const char* name, uint64_t start, uint64_t end)
+		{
+			auto const n = written_.load(memory_order_relaxed);
+
+			// pairs with the reader's fence ... a reader that sees any of
+			// these stores also sees written_ has reached n
+			atomic_thread_fence(memory_order_release);
+
+			if (!events_) {
+				events_.reset(new Event[capacity]);
+			}
+
+			auto& e = events_[n % capacity];
+			e.name.store(name, memory_order_relaxed);
+			e.start.store(start, memory_order_relaxed);
+			e.end.store(end, memory_order_relaxed);
+			written_.store(n + 1, memory_order_release);
+		}
+
+		vector<Zone> snapshot() const
+		{
+			auto const end = written_.load(memory_order_acquire);
+			auto const begin = (end > capacity) ? (end - capacity) : 0;
+
+			vector<Zone> zones;
+			if (!end) {
+				return zones;
+			}
+
+			zones.reserve(static_cast<size_t>(end - begin));
+			for (auto n = begin; n < end; ++n)
+			{
+				auto const& e = events_[n % capacity];
+				Zone z;
+				z.name = e.name.load(memory_order_relaxed);
+				z.start = e.start.load(memory_order_relaxed);
+				z.end = e.end.load(memory_order_relaxed);
+				zones.push_back(z);
+			}
+
+			// drop the slots the writer got to while we were copying ... 
+			// including the one it may be part way through (event now 
+			// goes where now - capacity was)
+			atomic_thread_fence(memory_order_acquire);
+			auto const now = written_.load(memory_order_relaxed);
+			auto const lapped = (now + 1 > capacity) ? (now + 1 - capacity) : 0;
+			if (lapped > begin)
+			{
+				auto const stale = static_cast<size_t>(
+					min<uint64_t>(lapped - begin, zones.size()));
+				zones.erase(zones.begin(), zones.begin() + stale);
+			}
+			return zones;
+		}
+	};
+
+	//
+	// every thread that has recorded (buffers outlive their threads, so
+	// a trace still shows threads that have finished)
+	//
+	class Registry
+	{
+	private:
+		mutex lock_;
+		vector<shared_ptr<ThreadBuffer>> buffers_;
+
+	public:
+		shared_ptr<ThreadBuffer> add()
+		{
+			lock_guard<mutex> guard(lock_);
+			auto const buffer = make_shared<ThreadBuffer>(
+				static_cast<uint32_t>(buffers_.size() + 1));
+			buffers_.push_back(buffer);
+			return buffer;
+		}
+
+		vector<shared_ptr<ThreadBuffer>> buffers()
+		{
+			lock_guard<mutex> guard(lock_);
+			return buffers_;
+		}
+	};
+
+	Registry& registry()
+	{
+		static Registry registry;
+		return registry;
+	}
+
+	ThreadBuffer& this_thread_buffer()
+	{
+		thread_local shared_ptr<ThreadBuffer> buffer = registry().add();
+		return *buffer;
+	}
+
+	// ns as fractional us (the trace format's unit)
+	void write_us(ostringstream& out, uint64_t ns)
+	{
+		char buffer[32];
+		snprintf(buffer, sizeof(buffer), "%llu.%03u",
+			static_cast<unsigned long long>(ns / 1000),
+			static_cast<uint32_t>(ns % 1000));
+		out << buffer;
+	}
+}
+
+void trace_enable(bool enable) {
+	trace_enabled_ = enable;
+}
+
+void trace_thread_name(string const& name) {
+	this_thread_buffer().set_name(name);
+}
+
+void trace_record(const char* name, uint64_t start, uint64_t end) {
+	this_thread_buffer().record(name, start, end);
+}
+
+string trace_json()
+{
+	auto const buffers = registry().buffers();
+
+	// zones are relative to the earliest one, which keeps the numbers short
+	vector<vector<ThreadBuffer::Zone>> zones;
+	uint64_t origin = ~0ull;
+	for (auto const& buffer : buffers)
+	{
+		zones.push_back(buffer->snapshot());
+		for (auto const& z : zones.back()) {
+			origin = min(origin, z.start);
+		}
+	}
+
+	ostringstream out;
+	out << "{ \"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+
+	auto first = true;
+	for (size_t b = 0; b < buffers.size(); ++b)
+	{
+		auto const tid = buffers[b]->id();
+		auto const name = buffers[b]->name();
+		if (!name.empty())
+		{
+			out << (first ? "" : ",\n")
+				<< "{ \"ph\": \"M\", \"name\": \"thread_name\", \"pid\": 1, \"tid\": " << tid
+				<< ", \"args\": { \"name\": \"" << name << "\" } }";
+			first = false;
+		}
+
+		for (auto const& z : zones[b])
+		{
+			out << (first ? "" : ",\n")
+				<< "{ \"ph\": \"X\", \"name\": \"" << z.name
+				<< "\", \"pid\": 1, \"tid\": " << tid << ", \"ts\": ";
+			write_us(out, z.start - origin);
+			out << ", \"dur\": ";
+			write_us(out, (z.end > z.start) ? (z.end - z.start) : 0);
+			out << " }";
+			first = false;
+		}
+	}
+
+	out << "\n] }\n";
+	return out.str();
+}
+
+bool trace_save(string const& file)
+{
+	ofstream out(file);
+	out << trace_json();
+	if (!out)
+	{
+		log_message("failed to write trace '%s'\n", file.c_str());
+		return false;
+	}
+	return true;
+}
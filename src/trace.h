@@ -0,0 +1,72 @@
+// Copyright (c) 2018 Daktronics. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include "util.h"
+
+#include <atomic>
+
+//
+// per-frame phase tracing ... scoped zones are recorded (while tracing is
+// enabled) into a ring buffer per thread, and can be written out at any
+// time as Chrome trace json (chrome://tracing or ui.perfetto.dev)
+//
+// recording is a couple of clock reads and three relaxed stores into the
+// thread's own buffer ... no locks, so zones can go anywhere hot
+//
+
+extern std::atomic_bool trace_enabled_;
+
+inline bool trace_enabled() {
+	return trace_enabled_.load(std::memory_order_relaxed);
+}
+
+void trace_enable(bool);
+
+// names the calling thread in the trace (eg. "producer")
+void trace_thread_name(std::string const&);
+
+// the most recent zones from every thread that recorded any
+std::string trace_json();
+
+// false (and logged) if the file can't be written
+bool trace_save(std::string const& file);
+
+// name must be a string literal (or otherwise outlive the trace)
+void trace_record(const char* name, uint64_t start, uint64_t end);
+
+//
+// a zone covering its own scope
+//
+class TraceZone
+{
+private:
+	const char* const name_;
+	uint64_t const start_;
+
+public:
+	// 0 start = tracing was off when the zone opened
+	TraceZone(const char* name)
+		: name_(name)
+		, start_(trace_enabled() ? time_now_ns() : 0) {
+	}
+
+	~TraceZone()
+	{
+		if (start_) {
+			trace_record(name_, start_, time_now_ns());
+		}
+	}
+
+private:
+	TraceZone(TraceZone const&) = delete;
+	TraceZone& operator=(TraceZone const&) = delete;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+// TRACE_ZONE("render") ... traces the rest of the enclosing scope
+#define TRACE_ZONE(name) TraceZone TRACE_CONCAT(trace_zone_, __LINE__)(name)
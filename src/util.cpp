@@ -2,7 +2,14 @@
 // Use of this source code is governed by a MIT-style license that can be
 // found in the LICENSE file.
 
+#if defined(_WIN32)
 #include "platform.h"
+#else
+#include <assert.h>
+#include <string.h>
+#include <wchar.h>
+#endif
+
 #include "util.h"
 
 #include <stdio.h>
@@ -10,20 +17,154 @@
 
 #include <memory>
 #include <sstream>
+#include <algorithm>
+#include <thread>
+
+#if !defined(_WIN32)
+#include <chrono>
+#include <locale>
+#include <codecvt>
+#endif
 
 using namespace std;
 
-LARGE_INTEGER qi_freq_ = {};
+#if defined(_WIN32)
 
-uint64_t time_now()
+uint64_t time_now_ns()
 {
-	if (!qi_freq_.HighPart && !qi_freq_.LowPart) {
-		QueryPerformanceFrequency(&qi_freq_);
-	}
+	// read once ... the counter frequency is fixed at boot.  a function
+	// local so it's valid for globals (eg. a Clock) constructed during
+	// static initialization, before this file's own globals are
+	static int64_t const qpc_freq_ = []() {
+		LARGE_INTEGER freq = {};
+		QueryPerformanceFrequency(&freq);
+		return freq.QuadPart;
+	}();
+
 	LARGE_INTEGER t = {};
 	QueryPerformanceCounter(&t);
+
+	// whole seconds and the remainder separately, so the integer math
+	// neither overflows nor loses precision
+	auto const seconds = t.QuadPart / qpc_freq_;
+	auto const ticks = t.QuadPart % qpc_freq_;
 	return static_cast<uint64_t>(
-		(t.QuadPart / double(qi_freq_.QuadPart)) * 1000000);
+		seconds * 1000000000ll + (ticks * 1000000000ll) / qpc_freq_);
+}
+
+#else
+
+uint64_t time_now_ns()
+{
+	return static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(
+		chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+#endif
+
+uint64_t time_now()
+{
+	return time_now_ns() / 1000;
+}
+
+#if defined(_WIN32) && !defined(CREATE_WAITABLE_TIMER_HIGH_RESOLUTION)
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+
+namespace {
+
+	//
+	// a waitable timer for each thread that waits ... high resolution
+	// where the os has it (windows 10 1803+), otherwise a regular one that
+	// only fires on the system tick (elsewhere it's a plain sleep)
+	//
+	class WaitTimer
+	{
+	public:
+		// how late the timer has been waking us (us) ... we ask to be woken
+		// this much early and spin the rest
+		uint64_t slack;
+
+#if defined(_WIN32)
+		HANDLE handle;
+
+		WaitTimer()
+			: slack(2000)
+		{
+			handle = CreateWaitableTimerExW(nullptr, nullptr,
+				CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+			if (!handle) {
+				handle = CreateWaitableTimerExW(nullptr, nullptr, 0, TIMER_ALL_ACCESS);
+			}
+		}
+
+		~WaitTimer()
+		{
+			if (handle) {
+				CloseHandle(handle);
+			}
+		}
+
+		bool valid() const {
+			return handle != nullptr;
+		}
+
+		void sleep(uint64_t us)
+		{
+			// relative due time in 100ns units
+			LARGE_INTEGER due;
+			due.QuadPart = -static_cast<LONGLONG>(us * 10);
+			if (!SetWaitableTimer(handle, &due, 0, nullptr, nullptr, FALSE) ||
+				WaitForSingleObject(handle, INFINITE) != WAIT_OBJECT_0) {
+				CloseHandle(handle);
+				handle = nullptr;
+			}
+		}
+#else
+		WaitTimer()
+			: slack(2000) {
+		}
+
+		bool valid() const {
+			return true;
+		}
+
+		void sleep(uint64_t us) {
+			this_thread::sleep_for(chrono::microseconds(us));
+		}
+#endif
+	};
+}
+
+void wait_until(uint64_t t)
+{
+	thread_local WaitTimer timer;
+
+	// a one-off late wake-up can't leave us spinning for good
+	timer.slack = max<uint64_t>(timer.slack - timer.slack / 32, 100);
+
+	for (auto now = time_now(); now < t; now = time_now())
+	{
+		auto const remaining = t - now;
+		if (timer.valid() && remaining > (timer.slack + 500))
+		{
+			auto const sleep = remaining - timer.slack;
+			timer.sleep(sleep);
+			if (!timer.valid()) {
+				continue;
+			}
+
+			// follow a later wake-up right away, an earlier one gradually
+			auto const slept = time_now() - now;
+			auto const late = (slept > sleep) ? (slept - sleep) : 0;
+			timer.slack = (late > timer.slack) ? late : ((timer.slack * 15 + late) / 16);
+			timer.slack = min<uint64_t>(max<uint64_t>(timer.slack, 100), 20000);
+		}
+		else {
+			// the last stretch ... let anything else that's ready run
+			this_thread::yield();
+		}
+	}
 }
 
 void log_message(const char* msg, ...)
@@ -39,7 +180,11 @@ void log_message(const char* msg, ...)
 		va_start(args, msg);
 		auto const ret = vsnprintf(buff, max_cch, msg, args);
 		assert(ret >= 0 && ret < max_cch);
+#if defined(_WIN32)
 		OutputDebugStringA(buff);
+#else
+		fputs(buff, stderr);
+#endif
 	}
 }
 
@@ -123,6 +268,10 @@ string to_utf8(const wchar_t* utf16)
 		return string();
 	}
 
+#if !defined(_WIN32)
+	return wstring_convert<codecvt_utf8<wchar_t>>().to_bytes(utf16);
+#else
+
 	auto const cch = static_cast<int>(wcslen(utf16));
 	shared_ptr<char> utf8;
 	auto const cb = WideCharToMultiByte(CP_UTF8, 0, utf16, cch,
@@ -137,6 +286,7 @@ string to_utf8(const wchar_t* utf16)
 		return string();
 	}
 	return string(utf8.get(), cb);
+#endif
 }
 
 std::wstring to_utf16(string const& utf8)
@@ -153,6 +303,10 @@ wstring to_utf16(const char* utf8)
 		return wstring();
 	}
 
+#if !defined(_WIN32)
+	return wstring_convert<codecvt_utf8<wchar_t>>().from_bytes(utf8);
+#else
+
 	auto const cb = static_cast<int>(strlen(utf8));
 	shared_ptr<WCHAR> utf16;
 	auto const cch = MultiByteToWideChar(CP_UTF8, 0, utf8, cb, nullptr, 0);
@@ -167,6 +321,7 @@ wstring to_utf16(const char* utf8)
 		return wstring();
 	}
 	return wstring(utf16.get(), cch);
+#endif
 }
 
 int to_int(std::string s, int default_val)
@@ -179,3 +334,19 @@ int to_int(std::string s, int default_val)
 	}
 	return default_val;
 }
+
+//
+// the sample at sorted index p * (n - 1), rounded to the nearest (p is 
+// 0.0 - 1.0, so 0 is the minimum and 1 the maximum) ... samples are taken
+// by value as they get reordered
+//
+double percentile(vector<double> samples, double p)
+{
+	if (samples.empty()) {
+		return 0.0;
+	}
+	auto const n = static_cast<size_t>(p * (samples.size() - 1) + 0.5);
+	auto const nth = samples.begin() + min(n, samples.size() - 1);
+	nth_element(samples.begin(), nth, samples.end());
+	return *nth;
+}
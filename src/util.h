@@ -26,8 +26,16 @@ struct color {
 	float a;
 };
 
+// monotonic time in microseconds
 uint64_t time_now();
 
+// monotonic time in nanoseconds ... integer math only
+uint64_t time_now_ns();
+
+// block until time_now() reaches t ... sleeps on a high resolution timer
+// for the bulk of the wait and spins (yielding) only the last stretch
+void wait_until(uint64_t t);
+
 void log_message(const char*, ...);
 
 std::string to_utf8(const wchar_t*);
@@ -43,6 +51,8 @@ std::vector<std::string> split(std::string const& input, char sep);
 
 int to_int(std::string, int default_val);
 
+double percentile(std::vector<double> samples, double p);
+
 color parse_color(std::string const&);
 
 // 